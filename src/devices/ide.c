@@ -3,12 +3,16 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -30,10 +34,25 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus-master IDE port addresses, relative to the channel's
+   bus-master base. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus-master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus-master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Interrupt (write 1 to clear). */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +68,15 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors that one command can transfer, because the
+   Sector Count register is 8 bits wide (0 means 256). */
+#define MAX_COMMAND_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +85,24 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple_cnt;           /* Sectors per interrupt under READ/WRITE
+                                   MULTIPLE, or 1 if not supported. */
+    bool dma;                   /* Does the disk support DMA? */
+  };
+
+/* Physical Region Descriptor, one entry in the table that tells
+   a bus-master IDE controller where in memory to move data.  A
+   region may not cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address of region. */
+    uint16_t size;              /* Size of region in bytes, 0 = 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
   };
 
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_MAX (PGSIZE / sizeof (struct prd))  /* Entries per table. */
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -72,20 +116,59 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus-master I/O base, 0 if none. */
+    struct prd *prdt;           /* PRD table, one page, for DMA. */
+
+    /* Requests waiting for the dispatcher, ordered by
+       request_less(). */
+    struct list queue;          /* List of struct ide_request. */
+    struct lock queue_lock;     /* Protects QUEUE and the head. */
+    struct condition queue_ready;   /* Signaled on new request. */
+    int head_dev;               /* Device of last batch served. */
+    block_sector_t head_sector; /* Sector just past last batch. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
+/* A request to move sectors between a disk and memory, waiting
+   in its channel's queue or being served by the dispatcher. */
+struct ide_request
+  {
+    struct list_elem elem;      /* Element in queue or batch. */
+    struct ata_disk *disk;      /* Disk to transfer to or from. */
+    block_sector_t sec_no;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    uint8_t *buffer;            /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool to_disk;               /* True for a write, false for a read. */
+    struct semaphore done;      /* Up'd when the transfer is complete. */
+  };
+
 /* We support the two "legacy" ATA channels found in a standard PC. */
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
+static void ide_read_multi (void *, block_sector_t, size_t cnt, void *);
+static void ide_write_multi (void *, block_sector_t, size_t cnt,
+                             const void *);
+static void submit_request (struct ata_disk *, block_sector_t, size_t cnt,
+                            uint8_t *buffer, bool to_disk);
+static thread_func dispatcher NO_RETURN;
 
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, int multiple_cnt);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static uint16_t find_bus_master (void);
+
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      struct list *batch);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       struct list *batch);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          struct list *batch, bool to_disk);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -101,6 +184,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +210,25 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      list_init (&c->queue);
+      lock_init (&c->queue_lock);
+      cond_init (&c->queue_ready);
+      c->head_dev = 0;
+      c->head_sector = 0;
+      thread_create (c->name, PRI_MAX, dispatcher, c);
+
+      /* Set up bus-master DMA, if the controller supports it.
+         The primary channel's registers come first, followed by
+         the secondary's. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +239,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple_cnt = 1;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -289,6 +394,15 @@ identify_ata_device (struct ata_disk *d)
   snprintf (extra_info, sizeof extra_info,
             "model \"%s\", serial \"%s\"", model, serial);
 
+  /* Word 47 gives the most sectors the disk can transfer per
+     interrupt with READ/WRITE MULTIPLE. */
+  set_multiple_mode (d, *(uint8_t *) &id[47 * 2]);
+
+  /* Bit 8 of word 49 says whether the disk supports DMA. */
+  d->dma = (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+  if (d->dma && c->bm_base != 0)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
      allow access to those, we're less likely to scribble on
@@ -309,6 +423,98 @@ identify_ata_device (struct ata_disk *d)
   partition_scan (block);
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D with MULTIPLE_CNT
+   sectors per interrupt.  Leaves D transferring one sector per
+   interrupt if MULTIPLE_CNT is less than 2 or the disk rejects
+   the setting. */
+static void
+set_multiple_mode (struct ata_disk *d, int multiple_cnt)
+{
+  struct channel *c = d->channel;
+
+  d->multiple_cnt = 1;
+  if (multiple_cnt < 2)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), multiple_cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple_cnt = multiple_cnt;
+}
+
+/* PCI configuration space access. */
+
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Configuration address port. */
+#define PCI_CONFIG_DATA 0xcfc           /* Configuration data port. */
+
+/* Returns the 32-bit word at byte offset REG in the
+   configuration space of PCI function BUS:DEV.FUNC. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xfc));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit word at byte offset REG in the
+   configuration space of PCI function BUS:DEV.FUNC. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xfc));
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller capable of bus-master
+   DMA, such as the PIIX emulated by QEMU.  If one is found,
+   enables it as a bus master and returns the I/O base of its
+   bus-master registers.  Returns 0 if there is none, in which
+   case all transfers use PIO. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t id = pci_read_config (0, dev, func, 0x00);
+        uint32_t class = pci_read_config (0, dev, func, 0x08);
+        uint32_t bar4;
+
+        if ((id & 0xffff) == 0xffff)
+          {
+            /* No such function.  If function 0 is missing, so
+               is the whole device. */
+            if (func == 0)
+              break;
+            continue;
+          }
+
+        /* Class 01h (mass storage), subclass 01h (IDE), with bit 7
+           of the programming interface set (bus master). */
+        if ((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+          continue;
+
+        /* BAR 4 holds the bus-master registers, which must be in
+           I/O space. */
+        bar4 = pci_read_config (0, dev, func, 0x20);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space access and bus mastering. */
+        pci_write_config (0, dev, func, 0x04,
+                          pci_read_config (0, dev, func, 0x04) | 0x05);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -344,16 +550,7 @@ descramble_ata_string (char *string, int size)
 static void
 ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  ide_read_multi (d_, sec_no, 1, buffer);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -364,36 +561,209 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  ide_write_multi (d_, sec_no, 1, buffer);
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multi (void *d_, block_sector_t sec_no, size_t cnt, void *buffer_)
+{
+  uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t request_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      submit_request (d_, sec_no, request_cnt, buffer, false);
+      sec_no += request_cnt;
+      buffer += request_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= request_cnt;
+    }
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving all of the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multi (void *d_, block_sector_t sec_no, size_t cnt,
+                 const void *buffer_)
+{
+  const uint8_t *buffer = buffer_;
+
+  while (cnt > 0)
+    {
+      size_t request_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      submit_request (d_, sec_no, request_cnt, (uint8_t *) buffer, true);
+      sec_no += request_cnt;
+      buffer += request_cnt * BLOCK_SECTOR_SIZE;
+      cnt -= request_cnt;
+    }
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multi,
+    ide_write_multi
   };
+
+/* Request queue. */
+
+/* Returns true if request A comes before request B in the order
+   in which the dispatcher sweeps across the disks: by device,
+   then by sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct ide_request *a = list_entry (a_, struct ide_request, elem);
+  const struct ide_request *b = list_entry (b_, struct ide_request, elem);
+
+  if (a->disk->dev_no != b->disk->dev_no)
+    return a->disk->dev_no < b->disk->dev_no;
+  return a->sec_no < b->sec_no;
+}
+
+/* Queues a request to move CNT sectors, at most
+   MAX_COMMAND_SECTORS, starting at SEC_NO between disk D and
+   BUFFER, and waits for the dispatcher to complete it. */
+static void
+submit_request (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+                uint8_t *buffer, bool to_disk)
+{
+  struct channel *c = d->channel;
+  struct ide_request r;
+
+  r.disk = d;
+  r.sec_no = sec_no;
+  r.cnt = cnt;
+  r.buffer = buffer;
+  r.to_disk = to_disk;
+  sema_init (&r.done, 0);
+
+  lock_acquire (&c->queue_lock);
+  list_insert_ordered (&c->queue, &r.elem, request_less, NULL);
+  cond_signal (&c->queue_ready, &c->queue_lock);
+  lock_release (&c->queue_lock);
+
+  sema_down (&r.done);
+}
+
+/* Removes the next batch of requests to serve from C's queue and
+   moves them to BATCH.  The queue must not be empty.
+
+   The first request is chosen in C-LOOK order: the lowest request
+   at or past the end of the previous batch, or the lowest request
+   of all if the sweep has run off the end.  Requests that pick
+   up where it leaves off, on the same disk and in the same
+   direction, are merged into the batch as long as the total fits
+   in one command.  The caller must hold C's queue_lock. */
+static void
+take_batch (struct channel *c, struct list *batch)
+{
+  struct ide_request *first, *last;
+  struct list_elem *e;
+  size_t cnt;
+
+  ASSERT (!list_empty (&c->queue));
+
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    {
+      struct ide_request *r = list_entry (e, struct ide_request, elem);
+      if (r->disk->dev_no > c->head_dev
+          || (r->disk->dev_no == c->head_dev && r->sec_no >= c->head_sector))
+        break;
+    }
+  if (e == list_end (&c->queue))
+    e = list_begin (&c->queue);
+
+  first = last = list_entry (e, struct ide_request, elem);
+  cnt = first->cnt;
+  e = list_remove (e);
+  list_push_back (batch, &first->elem);
+
+  while (e != list_end (&c->queue))
+    {
+      struct ide_request *r = list_entry (e, struct ide_request, elem);
+      if (r->disk != first->disk || r->to_disk != first->to_disk
+          || r->sec_no != last->sec_no + last->cnt
+          || cnt + r->cnt > MAX_COMMAND_SECTORS)
+        break;
+      cnt += r->cnt;
+      last = r;
+      e = list_remove (e);
+      list_push_back (batch, &r->elem);
+    }
+
+  c->head_dev = first->disk->dev_no;
+  c->head_sector = last->sec_no + last->cnt;
+}
+
+/* Dispatcher thread for channel C_.  Serves queued requests in
+   batches chosen by take_batch(), each with a single command. */
+static void
+dispatcher (void *c_)
+{
+  struct channel *c = c_;
+
+  for (;;)
+    {
+      struct list batch;
+      struct ide_request *first;
+      size_t cnt = 0;
+      struct list_elem *e;
+
+      list_init (&batch);
+      lock_acquire (&c->queue_lock);
+      while (list_empty (&c->queue))
+        cond_wait (&c->queue_ready, &c->queue_lock);
+      take_batch (c, &batch);
+      lock_release (&c->queue_lock);
+
+      first = list_entry (list_front (&batch), struct ide_request, elem);
+      for (e = list_begin (&batch); e != list_end (&batch); e = list_next (e))
+        cnt += list_entry (e, struct ide_request, elem)->cnt;
+
+      lock_acquire (&c->lock);
+      if (!dma_transfer (first->disk, first->sec_no, cnt, &batch,
+                         first->to_disk))
+        {
+          if (first->to_disk)
+            pio_write (first->disk, first->sec_no, cnt, &batch);
+          else
+            pio_read (first->disk, first->sec_no, cnt, &batch);
+        }
+      lock_release (&c->lock);
+
+      while (!list_empty (&batch))
+        {
+          struct ide_request *r = list_entry (list_pop_front (&batch),
+                                              struct ide_request, elem);
+          sema_up (&r->done);
+        }
+    }
+}
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the sector count CNT, which must be between
+   1 and MAX_COMMAND_SECTORS, to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_COMMAND_SECTORS ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -430,6 +800,163 @@ output_sector (struct channel *c, const void *sector)
   outsw (reg_data (c), sector, BLOCK_SECTOR_SIZE / 2);
 }
 
+/* Returns the buffer for the next sector of BATCH, a list of
+   requests, given that *E and *IDX point to the request and
+   sector within it to use, and advances them past it. */
+static uint8_t *
+next_sector_buffer (struct list_elem **e, size_t *idx)
+{
+  struct ide_request *r = list_entry (*e, struct ide_request, elem);
+  uint8_t *buffer = r->buffer + *idx * BLOCK_SECTOR_SIZE;
+
+  if (++*idx >= r->cnt)
+    {
+      *e = list_next (*e);
+      *idx = 0;
+    }
+  return buffer;
+}
+
+/* Reads CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO from disk D into the buffers of the requests in BATCH
+   in PIO mode.  The disk interrupts once per D->multiple_cnt
+   sectors.  The caller must hold D's channel lock. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          struct list *batch)
+{
+  struct channel *c = d->channel;
+  struct list_elem *e = list_begin (batch);
+  size_t idx = 0;
+  size_t left = cnt;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple_cnt > 1
+                         ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY));
+  while (left > 0)
+    {
+      size_t block_cnt = (left < (size_t) d->multiple_cnt
+                          ? left : (size_t) d->multiple_cnt);
+
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + (cnt - left));
+      for (; block_cnt > 0; block_cnt--, left--)
+        input_sector (c, next_sector_buffer (&e, &idx));
+    }
+}
+
+/* Writes CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO to disk D from the buffers of the requests in BATCH in
+   PIO mode, as pio_read() does.  Returns after the disk has
+   acknowledged receiving the data.  The caller must hold D's
+   channel lock. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           struct list *batch)
+{
+  struct channel *c = d->channel;
+  struct list_elem *e = list_begin (batch);
+  size_t idx = 0;
+  size_t left = cnt;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, (d->multiple_cnt > 1
+                         ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY));
+  while (left > 0)
+    {
+      size_t block_cnt = (left < (size_t) d->multiple_cnt
+                          ? left : (size_t) d->multiple_cnt);
+
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + (cnt - left));
+      for (; block_cnt > 0; block_cnt--, left--)
+        output_sector (c, next_sector_buffer (&e, &idx));
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Fills in C's PRD table to describe the buffers of the requests
+   in BATCH, in order.  Returns false if any buffer is not
+   word-aligned kernel memory, which the controller cannot use,
+   or if the buffers take more entries than the table holds. */
+static bool
+build_prd_table (struct channel *c, struct list *batch)
+{
+  struct list_elem *e;
+  size_t i = 0;
+
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct ide_request *r = list_entry (e, struct ide_request, elem);
+      uint8_t *buffer = r->buffer;
+      size_t size = r->cnt * BLOCK_SECTOR_SIZE;
+
+      if (!is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1) != 0)
+        return false;
+      while (size > 0)
+        {
+          uintptr_t addr = vtop (buffer);
+          size_t region = 0x10000 - (addr & 0xffff);
+          if (region > size)
+            region = size;
+
+          if (i >= PRD_MAX)
+            return false;
+          c->prdt[i].addr = addr;
+          c->prdt[i].size = region & 0xffff;
+          c->prdt[i].flags = 0;
+          i++;
+
+          buffer += region;
+          size -= region;
+        }
+    }
+  c->prdt[i - 1].flags = PRD_EOT;
+  return true;
+}
+
+/* Moves CNT sectors, at most MAX_COMMAND_SECTORS, starting at
+   SEC_NO between disk D and the buffers of the requests in BATCH
+   by bus-master DMA, to the disk if TO_DISK is true and from it
+   otherwise.  The CPU is free to run other threads until the
+   transfer completes.  Returns false without doing anything if
+   DMA cannot be used, because the controller or disk lacks it or
+   a buffer is unsuitable.  The caller must hold D's channel
+   lock. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              struct list *batch, bool to_disk)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = to_disk ? 0 : BM_CMD_READ;
+  uint8_t bm_status;
+
+  if (c->bm_base == 0 || !d->dma || !build_prd_table (c, batch))
+    return false;
+
+  /* Program the controller, then the disk, then start. */
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_command (c), direction);
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, to_disk ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+
+  sema_down (&c->completion_wait);
+
+  outb (reg_bm_command (c), direction);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), BM_STA_ERR | BM_STA_INTR);
+  if ((bm_status & BM_STA_ERR) != 0
+      || (inb (reg_status (c)) & STA_ERR) != 0)
+    PANIC ("%s: DMA %s failed, sector=%"PRDSNu,
+           d->name, to_disk ? "write" : "read", sec_no);
+  return true;
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -25,8 +25,14 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Threads sleeping in timer_sleep(), in increasing order of
+   wakeup_tick, so that the interrupt handler only has to look at
+   the front of the list. */
+static struct list sleep_list;
+
 static intr_handler_func timer_interrupt;
-static void check_ticks(struct thread* t, void* aux UNUSED);
+static bool wakeup_less (const struct list_elem *, const struct list_elem *,
+                         void *aux);
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
@@ -38,6 +44,7 @@ void
 timer_init (void) 
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&sleep_list);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 } 
 
@@ -91,22 +98,21 @@ timer_elapsed (int64_t then)
 void
 timer_sleep (int64_t ticks) 
 { 
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
   ASSERT (intr_get_level () == INTR_ON);
+  ASSERT (!intr_context ());
 
   //Do not sleep if sleep time is negative
   if (ticks <= 0)
     return;
 
-  //Store sleep time in the actual thread
-  struct thread *cur = thread_current();
-  cur->sleepTime = ticks;
-
-  //Disable interrupts and block the thread
-  enum intr_level old_level;
-  ASSERT (!intr_context());
+  //Queue the thread by its absolute deadline and block it
   old_level = intr_disable ();
-  
-  thread_block();
+  cur->wakeup_tick = timer_ticks () + ticks;
+  list_insert_ordered (&sleep_list, &cur->elem, wakeup_less, NULL);
+  thread_block ();
   intr_set_level (old_level); 
 }
 
@@ -180,30 +186,37 @@ timer_print_stats (void)
   printf ("Timer: %"PRId64" ticks\n", timer_ticks ());
 }
 
-/* Timer interrupt handler. */
+/* Timer interrupt handler.  Wakes every sleeping thread whose
+   deadline has passed, which only requires looking at the front
+   of sleep_list. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
-  thread_foreach(check_ticks, 0);
+  while (!list_empty (&sleep_list))
+    {
+      struct thread *t = list_entry (list_front (&sleep_list),
+                                     struct thread, elem);
+      if (t->wakeup_tick > ticks)
+        break;
+      list_pop_front (&sleep_list);
+      thread_unblock (t);
+    }
   thread_tick ();
+  thread_preempt ();
 }
 
-static void
-check_ticks(struct thread* t, void* aux UNUSED)
+/* Orders threads in sleep_list by increasing wakeup_tick.
+   Threads with equal deadlines keep the order they went to
+   sleep in. */
+static bool
+wakeup_less (const struct list_elem *a_, const struct list_elem *b_,
+             void *aux UNUSED)
 {
-  if (t->status == THREAD_BLOCKED){
-    //If sleep time is over, disable interrupts and unblock the thread
-    t->sleepTime--;      
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
 
-    if (t->sleepTime == 0){
-        enum intr_level old_level;
-        old_level = intr_disable ();
-
-        thread_unblock(t);
-        intr_set_level (old_level);
-    }
-  }
+  return a->wakeup_tick < b->wakeup_tick;
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
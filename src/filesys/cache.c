@@ -0,0 +1,402 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Buffer cache for file system sectors.
+
+   All file system reads and writes go through a fixed set of
+   CACHE_SIZE sector buffers.  Writes are absorbed by the cache
+   and written back to disk only when a dirty sector is evicted,
+   by the periodic write-behind thread, or by cache_flush().
+   Sequential readers can ask for the next sector to be brought
+   in asynchronously by the read-ahead thread.  Sectors written
+   by the journal are held in the cache, neither written back nor
+   evicted, until the journal commits them.
+
+   Synchronization: cache_lock protects the mapping from sectors
+   to entries, that is, each entry's SECTOR, VALID, ACCESSED, and
+   PIN_CNT members.  An entry's own lock protects its DATA,
+   DIRTY, and HELD members; HELD only changes while the entry is
+   pinned, so it may also be read under cache_lock for an unpinned
+   entry.  An entry with a nonzero PIN_CNT is in use and will not
+   be evicted.  A thread always pins an entry before
+   acquiring its lock and releases the lock before unpinning it,
+   so an unpinned entry's lock is always free. */
+
+/* Number of sectors in the cache. */
+#define CACHE_SIZE 64
+
+/* Milliseconds between passes of the write-behind thread. */
+#define WRITE_BEHIND_MS 5000
+
+/* Maximum number of pending read-ahead requests. */
+#define READAHEAD_MAX 16
+
+/* A cached sector. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Sector held, if VALID. */
+    bool valid;                         /* Holds a sector? */
+    bool accessed;                      /* Used since clock hand passed? */
+    int pin_cnt;                        /* Number of threads using it. */
+    struct lock lock;                   /* Protects DATA and DIRTY. */
+    bool dirty;                         /* Modified since last write? */
+    bool held;                          /* Awaiting journal commit? */
+
+    /* Sector contents, word-aligned so that the disk can DMA
+       directly into and out of it. */
+    uint8_t data[BLOCK_SECTOR_SIZE] __attribute__ ((aligned (4)));
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;          /* Protects sector mapping. */
+static struct condition cache_unpinned; /* Signaled when a pin drops. */
+static size_t clock_hand;               /* Next eviction candidate. */
+
+/* Read-ahead requests, a circular queue of sector numbers. */
+static block_sector_t readahead_queue[READAHEAD_MAX];
+static size_t readahead_head;           /* Index of oldest request. */
+static size_t readahead_cnt;            /* Number of requests queued. */
+static struct lock readahead_lock;      /* Protects the queue. */
+static struct condition readahead_ready;  /* Signaled on new request. */
+
+static thread_func write_behind NO_RETURN;
+static thread_func read_ahead NO_RETURN;
+static struct cache_entry *cache_lookup (block_sector_t);
+static struct cache_entry *cache_get (block_sector_t, bool load);
+static void cache_put (struct cache_entry *);
+
+/* Initializes the buffer cache and starts its helper threads. */
+void
+cache_init (void)
+{
+  size_t i;
+
+  lock_init (&cache_lock);
+  cond_init (&cache_unpinned);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->valid = false;
+      e->accessed = false;
+      e->pin_cnt = 0;
+      lock_init (&e->lock);
+      e->dirty = false;
+      e->held = false;
+    }
+  clock_hand = 0;
+
+  lock_init (&readahead_lock);
+  cond_init (&readahead_ready);
+  readahead_head = readahead_cnt = 0;
+
+  thread_create ("cache-flush", PRI_DEFAULT, write_behind, NULL);
+  thread_create ("cache-readahead", PRI_DEFAULT, read_ahead, NULL);
+}
+
+/* Writes all dirty sectors to disk.  Called at shutdown. */
+void
+cache_done (void)
+{
+  cache_flush ();
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void
+cache_read (block_sector_t sector, void *buffer)
+{
+  cache_read_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte offset OFS within sector
+   SECTOR into BUFFER. */
+void
+cache_read_at (block_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, true);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e);
+}
+
+/* Writes BUFFER, which must contain BLOCK_SECTOR_SIZE bytes, to
+   sector SECTOR. */
+void
+cache_write (block_sector_t sector, const void *buffer)
+{
+  cache_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, starting at
+   byte offset OFS within the sector.  The sector is read from
+   disk first only if the write does not cover all of it. */
+void
+cache_write_at (block_sector_t sector, const void *buffer,
+                size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, ofs != 0 || size != BLOCK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  cache_put (e);
+}
+
+/* Writes SIZE bytes from BUFFER into sector SECTOR, as
+   cache_write_at() does, and holds the sector in the cache until
+   cache_unhold() is called for it.  If the sector is dirty but
+   not held, its contents are written back first, so that the
+   disk keeps the last committed version while it is held. */
+void
+cache_hold_at (block_sector_t sector, const void *buffer,
+               size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get (sector, ofs != 0 || size != BLOCK_SECTOR_SIZE);
+  if (e->dirty && !e->held)
+    block_write (fs_device, e->sector, e->data);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  e->held = true;
+  cache_put (e);
+}
+
+/* Lets held sector SECTOR be written back and evicted again. */
+void
+cache_unhold (block_sector_t sector)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  e = cache_lookup (sector);
+  ASSERT (e != NULL);
+  e->pin_cnt++;
+  lock_release (&cache_lock);
+
+  lock_acquire (&e->lock);
+  e->held = false;
+  cache_put (e);
+}
+
+/* Asks for SECTOR to be brought into the cache in the
+   background.  The request is dropped if too many are already
+   pending. */
+void
+cache_readahead (block_sector_t sector)
+{
+  lock_acquire (&readahead_lock);
+  if (readahead_cnt < READAHEAD_MAX)
+    {
+      readahead_queue[(readahead_head + readahead_cnt) % READAHEAD_MAX]
+        = sector;
+      readahead_cnt++;
+      cond_signal (&readahead_ready, &readahead_lock);
+    }
+  lock_release (&readahead_lock);
+}
+
+/* Writes every dirty sector in the cache to disk, except those
+   that are held. */
+void
+cache_flush (void)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+
+      lock_acquire (&cache_lock);
+      if (!e->valid || !e->dirty || e->held)
+        {
+          lock_release (&cache_lock);
+          continue;
+        }
+      e->pin_cnt++;
+      lock_release (&cache_lock);
+
+      lock_acquire (&e->lock);
+      if (e->dirty && !e->held)
+        {
+          block_write (fs_device, e->sector, e->data);
+          e->dirty = false;
+        }
+      cache_put (e);
+    }
+}
+
+/* Returns the entry with SECTOR in it, or a null pointer if
+   SECTOR is not cached.  The caller must hold cache_lock. */
+static struct cache_entry *
+cache_lookup (block_sector_t sector)
+{
+  size_t i;
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Chooses an unpinned, unheld entry to reuse with the clock
+   algorithm, preferring entries that are empty or have not been
+   used since the hand last passed them.  Returns a null pointer
+   if every entry is pinned or held.  The caller must hold
+   cache_lock. */
+static struct cache_entry *
+cache_choose_victim (void)
+{
+  size_t i;
+
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (e->pin_cnt > 0 || e->held)
+        continue;
+      if (!e->valid || !e->accessed)
+        return e;
+      e->accessed = false;
+    }
+  return NULL;
+}
+
+/* Unpins E.  The caller must hold cache_lock. */
+static void
+cache_unpin (struct cache_entry *e)
+{
+  ASSERT (e->pin_cnt > 0);
+  if (--e->pin_cnt == 0)
+    cond_signal (&cache_unpinned, &cache_lock);
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held,
+   evicting another sector to make room if necessary.  If LOAD is
+   true, a newly cached sector is read from disk; otherwise, the
+   caller must overwrite the entire sector.  Release the entry
+   with cache_put(). */
+static struct cache_entry *
+cache_get (block_sector_t sector, bool load)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      e = cache_lookup (sector);
+      if (e != NULL)
+        {
+          /* Already cached.  If another thread is still reading
+             it in, acquiring the lock waits for that to finish. */
+          e->pin_cnt++;
+          e->accessed = true;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          return e;
+        }
+
+      e = cache_choose_victim ();
+      if (e == NULL)
+        {
+          cond_wait (&cache_unpinned, &cache_lock);
+          continue;
+        }
+
+      if (e->valid && e->dirty)
+        {
+          /* Write the victim back without holding cache_lock,
+             then start over, because SECTOR may have been cached
+             by another thread in the meantime. */
+          e->pin_cnt++;
+          lock_release (&cache_lock);
+          lock_acquire (&e->lock);
+          if (e->dirty && !e->held)
+            {
+              block_write (fs_device, e->sector, e->data);
+              e->dirty = false;
+            }
+          lock_release (&e->lock);
+          lock_acquire (&cache_lock);
+          cache_unpin (e);
+          continue;
+        }
+
+      /* E is unpinned, so its lock is free and this does not
+         sleep while holding cache_lock. */
+      e->pin_cnt++;
+      lock_acquire (&e->lock);
+      e->sector = sector;
+      e->valid = true;
+      e->accessed = true;
+      e->dirty = false;
+      lock_release (&cache_lock);
+
+      if (load)
+        block_read (fs_device, sector, e->data);
+      return e;
+    }
+}
+
+/* Releases E, which was obtained from cache_get(). */
+static void
+cache_put (struct cache_entry *e)
+{
+  lock_release (&e->lock);
+  lock_acquire (&cache_lock);
+  cache_unpin (e);
+  lock_release (&cache_lock);
+}
+
+/* Write-behind thread.  Periodically writes dirty sectors to
+   disk, so that little data is lost on a crash even though
+   writes are normally absorbed by the cache.  Committing the
+   journal's running transaction brings in the free map's pending
+   changes and writes the cache back, so that they go out in the
+   same pass. */
+static void
+write_behind (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_msleep (WRITE_BEHIND_MS);
+      journal_commit ();
+    }
+}
+
+/* Read-ahead thread.  Brings requested sectors into the cache
+   so that a sequential reader finds them there. */
+static void
+read_ahead (void *aux UNUSED)
+{
+  for (;;)
+    {
+      block_sector_t sector;
+
+      lock_acquire (&readahead_lock);
+      while (readahead_cnt == 0)
+        cond_wait (&readahead_ready, &readahead_lock);
+      sector = readahead_queue[readahead_head];
+      readahead_head = (readahead_head + 1) % READAHEAD_MAX;
+      readahead_cnt--;
+      lock_release (&readahead_lock);
+
+      cache_put (cache_get (sector, true));
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+void cache_init (void);
+void cache_done (void);
+
+void cache_read (block_sector_t, void *);
+void cache_read_at (block_sector_t, void *, size_t ofs, size_t size);
+void cache_write (block_sector_t, const void *);
+void cache_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_hold_at (block_sector_t, const void *, size_t ofs, size_t size);
+void cache_unhold (block_sector_t);
+void cache_readahead (block_sector_t);
+void cache_flush (void);
+
+#endif /* filesys/cache.h */
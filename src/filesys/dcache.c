@@ -0,0 +1,217 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Directory entry cache.
+
+   Remembers the results of recent directory lookups, keyed by
+   the sector of the directory's inode and the name looked up,
+   so that walking a path that was walked recently does not
+   search each directory on disk.  A name that was not found is
+   remembered too, as a "negative" entry with sector DCACHE_NONE.
+   At most DCACHE_SIZE entries are kept; past that, the least
+   recently used entry is reused.
+
+   Directory code must call dcache_update() whenever it adds or
+   removes a name and dcache_purge() when it creates a directory
+   in a sector that may have held an older one.  A lookup that
+   misses the cache and goes to disk races with such changes, so
+   it samples dcache_generation() before searching and passes
+   the value to dcache_insert(), which drops the result if any
+   update happened in between. */
+
+/* Maximum number of cached entries. */
+#define DCACHE_SIZE 512
+
+/* A cached lookup result. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Name looked up. */
+    block_sector_t sector;              /* Inode sector or DCACHE_NONE. */
+  };
+
+static struct hash dentries;            /* All entries, by dir and name. */
+static struct list lru_list;            /* Most recently used first. */
+static size_t dentry_cnt;               /* Number of entries. */
+static unsigned generation;             /* Number of updates so far. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+static struct kmem_cache *dentry_cache; /* Allocates struct dentry. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void) 
+{
+  if (!hash_init (&dentries, dentry_hash, dentry_less, NULL))
+    PANIC ("dcache_init: out of memory");
+  list_init (&lru_list);
+  dentry_cnt = 0;
+  generation = 0;
+  lock_init (&dcache_lock);
+  dentry_cache = kmem_cache_create ("dentry", sizeof (struct dentry), NULL);
+  if (dentry_cache == NULL)
+    PANIC ("dcache_init: out of memory");
+}
+
+/* Returns the entry for NAME in directory DIR, or a null pointer
+   if there is none.  The caller must hold dcache_lock. */
+static struct dentry *
+find (block_sector_t dir, const char *name) 
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from the cache and frees it.  The caller must hold
+   dcache_lock. */
+static void
+discard (struct dentry *d) 
+{
+  hash_delete (&dentries, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  kmem_cache_free (dentry_cache, d);
+  dentry_cnt--;
+}
+
+/* Records that NAME in directory DIR refers to SECTOR, replacing
+   any existing entry.  The caller must hold dcache_lock. */
+static void
+store (block_sector_t dir, const char *name, block_sector_t sector) 
+{
+  struct dentry *d = find (dir, name);
+
+  if (d == NULL) 
+    {
+      if (strlen (name) > NAME_MAX)
+        return;
+      if (dentry_cnt >= DCACHE_SIZE)
+        discard (list_entry (list_back (&lru_list), struct dentry, lru_elem));
+      d = kmem_cache_alloc (dentry_cache);
+      if (d == NULL)
+        return;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+      dentry_cnt++;
+    }
+  d->sector = sector;
+}
+
+/* Looks up NAME in directory DIR.  If the result is cached,
+   sets *SECTOR to the inode sector that NAME refers to, or to
+   DCACHE_NONE if NAME does not exist, and returns true.
+   Otherwise, returns false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *sector) 
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL) 
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+      *sector = d->sector;
+    }
+  lock_release (&dcache_lock);
+
+  return d != NULL;
+}
+
+/* Returns a value to pass to dcache_insert() after looking up a
+   name on disk. */
+unsigned
+dcache_generation (void) 
+{
+  unsigned g;
+
+  lock_acquire (&dcache_lock);
+  g = generation;
+  lock_release (&dcache_lock);
+  return g;
+}
+
+/* Records the result of looking up NAME in directory DIR on
+   disk: SECTOR, or DCACHE_NONE if NAME was not found.  GEN is
+   the value dcache_generation() returned before the lookup
+   began.  If a directory has changed since then, the result may
+   be stale, so it is ignored. */
+void
+dcache_insert (block_sector_t dir, const char *name, block_sector_t sector,
+               unsigned gen) 
+{
+  lock_acquire (&dcache_lock);
+  if (gen == generation)
+    store (dir, name, sector);
+  lock_release (&dcache_lock);
+}
+
+/* Records that NAME in directory DIR has just been added with
+   its inode at SECTOR, or removed if SECTOR is DCACHE_NONE. */
+void
+dcache_update (block_sector_t dir, const char *name, block_sector_t sector) 
+{
+  lock_acquire (&dcache_lock);
+  generation++;
+  store (dir, name, sector);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every entry for directory DIR, which is about to be
+   created afresh. */
+void
+dcache_purge (block_sector_t dir) 
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  for (e = list_begin (&lru_list); e != list_end (&lru_list); e = next)
+    {
+      struct dentry *d = list_entry (e, struct dentry, lru_elem);
+      next = list_next (e);
+      if (d->dir == dir)
+        discard (d);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED) 
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED) 
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
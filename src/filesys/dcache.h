@@ -0,0 +1,20 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Sector recorded for a name known not to exist. */
+#define DCACHE_NONE ((block_sector_t) -1)
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t dir, const char *name,
+                    block_sector_t *sector);
+unsigned dcache_generation (void);
+void dcache_insert (block_sector_t dir, const char *name,
+                    block_sector_t sector, unsigned generation);
+void dcache_update (block_sector_t dir, const char *name,
+                    block_sector_t sector);
+void dcache_purge (block_sector_t dir);
+
+#endif /* filesys/dcache.h */
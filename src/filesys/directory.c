@@ -1,17 +1,78 @@
 #include "filesys/directory.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
 
+/* Hashed directories.
+
+   A directory made by dir_create() is an extendible hash table,
+   so that finding, adding, or removing an entry reads the same
+   small number of sectors however many entries the directory
+   holds.  The directory's file is divided into sector-sized
+   blocks:
+
+     - Block 0 is a header that gives the table's global depth D
+       and the blocks that hold the bucket table.
+
+     - The bucket table has 2**D entries, each the number of a
+       block holding a bucket.  A name belongs in the bucket
+       named by the low D bits of its hash_string() value.
+
+     - A bucket holds up to BUCKET_ENTRY_CNT entries whose hashes
+       agree in their low L bits, where L <= D is the bucket's
+       local depth.  A full bucket is split on bit L, doubling the
+       table first if L == D.  Once L reaches DIR_MAX_DEPTH, a
+       full bucket instead gains an overflow bucket, chained from
+       its NEXT member, so a directory never runs out of room.
+
+   Blocks are only ever appended to the file.  Directories
+   written before this format existed are a plain array of
+   entries without the header's magic number; they are still
+   searched linearly. */
+
+/* Identifies a hashed directory's header block. */
+#define DIR_MAGIC 0x48524944
+
+/* Identifies a bucket block. */
+#define BUCKET_MAGIC 0x544b4342
+
+/* Number of bucket table entries in a table block. */
+#define TABLE_ENTRY_CNT (BLOCK_SECTOR_SIZE / sizeof (uint32_t))
+
+/* Maximum number of table blocks. */
+#define TABLE_BLOCK_MAX 125
+
+/* Maximum global depth.  2**DIR_MAX_DEPTH table entries must fit
+   in TABLE_BLOCK_MAX table blocks.  Each block that dir_add()
+   changes is journaled in a single transaction, so the limit is
+   kept low enough that the table never outgrows 4 blocks; see
+   DIR_JOURNAL_SECTORS.  Buckets at this depth are chained
+   instead of split, which costs a lookup one more read for each
+   BUCKET_ENTRY_CNT entries past the 2**DIR_MAX_DEPTH buckets'
+   worth. */
+#define DIR_MAX_DEPTH 9
+
+/* Number of entries in a bucket. */
+#define BUCKET_ENTRY_CNT 25
+
 /* A directory. */
 struct dir 
   {
     struct inode *inode;                /* Backing store. */
     off_t pos;                          /* Current position. */
-    char name [NAME_MAX + 1];
+    bool hashed;                        /* Hashed or linear format? */
+
+    /* Hashed directories' readdir position: the last entry
+       returned, if any, by its key and name. */
+    bool started;                       /* Any entry returned yet? */
+    uint32_t last_key;                  /* entry_key() of last entry. */
+    char last_name[NAME_MAX + 1];       /* Name of last entry. */
   };
 
 /* A single directory entry. */
@@ -22,12 +83,93 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* Header block of a hashed directory.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_header
+  {
+    uint32_t magic;                     /* DIR_MAGIC. */
+    uint32_t depth;                     /* Global depth. */
+    uint32_t table_cnt;                 /* Number of table blocks. */
+    uint32_t tables[TABLE_BLOCK_MAX];   /* Blocks holding the table. */
+  };
+
+/* A bucket of directory entries.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    uint32_t magic;                     /* BUCKET_MAGIC. */
+    uint32_t depth;                     /* Local depth. */
+    struct dir_entry entries[BUCKET_ENTRY_CNT];
+    uint32_t next;                      /* Overflow bucket, or 0. */
+  };
+
+static bool read_word (const struct dir *, off_t ofs, uint32_t *);
+static bool write_word (struct dir *, off_t ofs, uint32_t);
+static bool read_block (const struct dir *, uint32_t block, void *);
+static bool write_block (struct dir *, uint32_t block, const void *);
+static bool is_dot_entry (const char *name);
+static bool is_empty (struct inode *);
+static bool hashed_next (struct dir *, char name[NAME_MAX + 1]);
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
+  struct dir dir;
+  struct dir_header *h;
+  struct dir_bucket *b;
+  uint32_t *table;
+  uint32_t depth, i;
+  void *block;
+  bool success = false;
+
+  ASSERT (sizeof *h == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof *b == BLOCK_SECTOR_SIZE);
+
+  /* Start with enough buckets for ENTRY_CNT entries, as long as
+     the table fits in a single block. */
+  for (depth = 0; (size_t) BUCKET_ENTRY_CNT << depth < entry_cnt; depth++)
+    if (1u << (depth + 1) > TABLE_ENTRY_CNT)
+      break;
+
+  if (!inode_create (sector, 0, true))
+    return false;
+  dcache_purge (sector);
+  dir.inode = inode_open (sector);
+  block = calloc (1, BLOCK_SECTOR_SIZE);
+  if (dir.inode == NULL || block == NULL)
+    goto done;
+
+  /* Header in block 0, table in block 1, buckets after that. */
+  h = block;
+  h->magic = DIR_MAGIC;
+  h->depth = depth;
+  h->table_cnt = 1;
+  h->tables[0] = 1;
+  if (!write_block (&dir, 0, h))
+    goto done;
+
+  table = block;
+  memset (table, 0, BLOCK_SECTOR_SIZE);
+  for (i = 0; i < 1u << depth; i++)
+    table[i] = 2 + i;
+  if (!write_block (&dir, 1, table))
+    goto done;
+
+  b = block;
+  memset (b, 0, BLOCK_SECTOR_SIZE);
+  b->magic = BUCKET_MAGIC;
+  b->depth = depth;
+  for (i = 0; i < 1u << depth; i++)
+    if (!write_block (&dir, 2 + i, b))
+      goto done;
+  success = true;
+
+ done:
+  inode_close (dir.inode);
+  free (block);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -38,8 +180,11 @@ dir_open (struct inode *inode)
   struct dir *dir = calloc (1, sizeof *dir);
   if (inode != NULL && dir != NULL)
     {
+      uint32_t magic;
+
       dir->inode = inode;
       dir->pos = 0;
+      dir->hashed = read_word (dir, 0, &magic) && magic == DIR_MAGIC;
       return dir;
     }
   else
@@ -84,6 +229,484 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
+
+/* Reads the 32-bit word at byte offset OFS in DIR into *WORD.
+   Returns true if successful, false on failure. */
+static bool
+read_word (const struct dir *dir, off_t ofs, uint32_t *word) 
+{
+  return inode_read_at (dir->inode, word, sizeof *word, ofs) == sizeof *word;
+}
+
+/* Writes WORD at byte offset OFS in DIR.
+   Returns true if successful, false on failure. */
+static bool
+write_word (struct dir *dir, off_t ofs, uint32_t word) 
+{
+  return inode_write_at (dir->inode, &word, sizeof word, ofs) == sizeof word;
+}
+
+/* Reads block BLOCK of DIR into BUFFER.
+   Returns true if successful, false on failure. */
+static bool
+read_block (const struct dir *dir, uint32_t block, void *buffer) 
+{
+  return (inode_read_at (dir->inode, buffer, BLOCK_SECTOR_SIZE,
+                         block * BLOCK_SECTOR_SIZE)
+          == BLOCK_SECTOR_SIZE);
+}
+
+/* Writes BUFFER to block BLOCK of DIR, extending DIR if BLOCK is
+   just past its end.  Returns true if successful, false on
+   failure. */
+static bool
+write_block (struct dir *dir, uint32_t block, const void *buffer) 
+{
+  return (inode_write_at (dir->inode, buffer, BLOCK_SECTOR_SIZE,
+                          block * BLOCK_SECTOR_SIZE)
+          == BLOCK_SECTOR_SIZE);
+}
+
+/* Returns the number of blocks in hashed directory DIR, which is
+   also the number of the next block to be added. */
+static uint32_t
+block_cnt (const struct dir *dir) 
+{
+  return inode_length (dir->inode) / BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the byte offset of entry SLOT in bucket block BLOCK. */
+static off_t
+entry_ofs (uint32_t block, size_t slot) 
+{
+  return (block * BLOCK_SECTOR_SIZE + offsetof (struct dir_bucket, entries)
+          + slot * sizeof (struct dir_entry));
+}
+
+/* Sets *OFS to the byte offset of entry IDX of DIR's bucket
+   table.  Returns true if successful, false on failure. */
+static bool
+table_ofs (const struct dir *dir, uint32_t idx, off_t *ofs) 
+{
+  uint32_t table;
+
+  if (!read_word (dir, offsetof (struct dir_header, tables)
+                  + idx / TABLE_ENTRY_CNT * sizeof (uint32_t), &table))
+    return false;
+  *ofs = table * BLOCK_SECTOR_SIZE + idx % TABLE_ENTRY_CNT * sizeof (uint32_t);
+  return true;
+}
+
+/* Finds the bucket in DIR for NAME and reads it into *B.  Sets
+   *IDX to the bucket table index for NAME and *BLOCK to the
+   bucket's block number.  Returns true if successful, false on
+   failure. */
+static bool
+find_bucket (const struct dir *dir, const char *name,
+             uint32_t *idx, uint32_t *block, struct dir_bucket *b) 
+{
+  uint32_t depth;
+  off_t ofs;
+
+  if (!read_word (dir, offsetof (struct dir_header, depth), &depth))
+    return false;
+  *idx = hash_string (name) & ((1u << depth) - 1);
+  if (!table_ofs (dir, *idx, &ofs)
+      || !read_word (dir, ofs, block)
+      || !read_block (dir, *block, b))
+    return false;
+  ASSERT (b->magic == BUCKET_MAGIC);
+  return true;
+}
+
+/* Doubles the size of hashed directory DIR's bucket table, which
+   has global depth DEPTH, so that each bucket is named by twice
+   as many table entries as before.  Returns true if successful,
+   false if the table is already as large as it can be or on
+   failure. */
+static bool
+double_table (struct dir *dir, uint32_t depth) 
+{
+  uint32_t *table;
+  uint32_t table_cnt, i;
+  bool success = false;
+
+  if (depth >= DIR_MAX_DEPTH)
+    return false;
+  table = malloc (BLOCK_SECTOR_SIZE);
+  if (table == NULL)
+    return false;
+
+  if (2u << depth <= TABLE_ENTRY_CNT) 
+    {
+      /* The table fits in its first block.  Copy the first half
+         of the entries into the second half. */
+      off_t ofs;
+
+      if (!table_ofs (dir, 0, &ofs)
+          || inode_read_at (dir->inode, table, BLOCK_SECTOR_SIZE, ofs)
+             != BLOCK_SECTOR_SIZE)
+        goto done;
+      for (i = 0; i < 1u << depth; i++)
+        table[(1u << depth) + i] = table[i];
+      if (inode_write_at (dir->inode, table, BLOCK_SECTOR_SIZE, ofs)
+          != BLOCK_SECTOR_SIZE)
+        goto done;
+    }
+  else 
+    {
+      /* Append a copy of each table block. */
+      if (!read_word (dir, offsetof (struct dir_header, table_cnt),
+                      &table_cnt))
+        goto done;
+      for (i = 0; i < table_cnt; i++) 
+        {
+          off_t ofs = offsetof (struct dir_header, tables);
+          uint32_t old_block, new_block = block_cnt (dir);
+
+          if (!read_word (dir, ofs + i * sizeof (uint32_t), &old_block)
+              || !read_block (dir, old_block, table)
+              || !write_block (dir, new_block, table)
+              || !write_word (dir, ofs + (table_cnt + i) * sizeof (uint32_t),
+                              new_block))
+            goto done;
+        }
+      if (!write_word (dir, offsetof (struct dir_header, table_cnt),
+                       2 * table_cnt))
+        goto done;
+    }
+
+  /* The table is now consistent at either depth, so it is safe
+     to switch over. */
+  success = write_word (dir, offsetof (struct dir_header, depth), depth + 1);
+
+ done:
+  free (table);
+  return success;
+}
+
+/* Splits bucket B of hashed directory DIR, which is in block
+   BLOCK and is named by bucket table entry IDX, moving half of
+   its entries into a new bucket.  Returns true if successful,
+   false if the directory cannot grow or on failure. */
+static bool
+split_bucket (struct dir *dir, uint32_t idx, uint32_t block,
+              struct dir_bucket *b) 
+{
+  struct dir_bucket *new_b;
+  uint32_t depth, bit, new_block, i;
+  bool success = false;
+
+  if (!read_word (dir, offsetof (struct dir_header, depth), &depth))
+    return false;
+  if (b->depth == depth) 
+    {
+      if (!double_table (dir, depth))
+        return false;
+      depth++;
+    }
+
+  new_b = calloc (1, sizeof *new_b);
+  if (new_b == NULL)
+    return false;
+
+  /* Move the entries whose hashes have bit B->DEPTH set. */
+  bit = 1u << b->depth;
+  new_b->magic = BUCKET_MAGIC;
+  new_b->depth = b->depth + 1;
+  for (i = 0; i < BUCKET_ENTRY_CNT; i++)
+    if (b->entries[i].in_use && (hash_string (b->entries[i].name) & bit))
+      {
+        new_b->entries[i] = b->entries[i];
+        b->entries[i].in_use = false;
+      }
+  b->depth++;
+
+  new_block = block_cnt (dir);
+  if (!write_block (dir, new_block, new_b) || !write_block (dir, block, b))
+    goto done;
+
+  /* Point the table entries with bit B->DEPTH set at the new
+     bucket. */
+  for (i = (idx & (bit - 1)) | bit; i < 1u << depth; i += bit << 1) 
+    {
+      off_t ofs;
+      if (!table_ofs (dir, i, &ofs) || !write_word (dir, ofs, new_block))
+        goto done;
+    }
+  success = true;
+
+ done:
+  free (new_b);
+  return success;
+}
+
+/* Searches hashed directory DIR for a file with the given NAME,
+   in the same way as lookup(). */
+static bool
+hashed_lookup (const struct dir *dir, const char *name,
+               struct dir_entry *ep, off_t *ofsp) 
+{
+  struct dir_bucket *b;
+  uint32_t idx, block;
+  size_t i;
+  bool found = false;
+
+  b = malloc (sizeof *b);
+  if (b == NULL || !find_bucket (dir, name, &idx, &block, b))
+    goto done;
+
+  for (;;) 
+    {
+      for (i = 0; i < BUCKET_ENTRY_CNT; i++)
+        if (b->entries[i].in_use && !strcmp (name, b->entries[i].name)) 
+          {
+            if (ep != NULL)
+              *ep = b->entries[i];
+            if (ofsp != NULL)
+              *ofsp = entry_ofs (block, i);
+            found = true;
+            goto done;
+          }
+      if (b->next == 0)
+        break;
+      block = b->next;
+      if (!read_block (dir, block, b))
+        break;
+    }
+
+ done:
+  free (b);
+  return found;
+}
+
+/* Adds a new overflow bucket to hashed directory DIR, holding
+   only an entry for NAME, whose inode is in INODE_SECTOR, and
+   chains it from bucket B, the last in its chain, in block BLOCK.
+   Returns true if successful, false on failure. */
+static bool
+add_overflow (struct dir *dir, uint32_t block, const struct dir_bucket *b,
+              const char *name, block_sector_t inode_sector) 
+{
+  struct dir_bucket *new_b;
+  uint32_t new_block = block_cnt (dir);
+  bool success;
+
+  new_b = calloc (1, sizeof *new_b);
+  if (new_b == NULL)
+    return false;
+  new_b->magic = BUCKET_MAGIC;
+  new_b->depth = b->depth;
+  new_b->entries[0].in_use = true;
+  strlcpy (new_b->entries[0].name, name, sizeof new_b->entries[0].name);
+  new_b->entries[0].inode_sector = inode_sector;
+
+  /* Write the bucket before linking it in. */
+  success = (write_block (dir, new_block, new_b)
+             && write_word (dir, (block * BLOCK_SECTOR_SIZE
+                                  + offsetof (struct dir_bucket, next)),
+                            new_block));
+  free (new_b);
+  return success;
+}
+
+/* Adds an entry for NAME, whose inode is in INODE_SECTOR, to
+   hashed directory DIR, splitting buckets or adding overflow
+   buckets as necessary.
+   Returns true if successful, false on failure. */
+static bool
+hashed_add (struct dir *dir, const char *name, block_sector_t inode_sector) 
+{
+  struct dir_bucket *b;
+  uint32_t idx, block;
+  bool success = false;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+
+  while (find_bucket (dir, name, &idx, &block, b))
+    {
+      size_t i;
+
+      /* Look for a free slot in the bucket and its overflow
+         chain, which only buckets at DIR_MAX_DEPTH have. */
+      for (;;) 
+        {
+          for (i = 0; i < BUCKET_ENTRY_CNT; i++)
+            if (!b->entries[i].in_use) 
+              {
+                struct dir_entry *e = &b->entries[i];
+
+                e->in_use = true;
+                strlcpy (e->name, name, sizeof e->name);
+                e->inode_sector = inode_sector;
+                success = (inode_write_at (dir->inode, e, sizeof *e,
+                                           entry_ofs (block, i))
+                           == sizeof *e);
+                goto done;
+              }
+          if (b->next == 0)
+            break;
+          block = b->next;
+          if (!read_block (dir, block, b))
+            goto done;
+        }
+
+      if (b->depth >= DIR_MAX_DEPTH) 
+        {
+          success = add_overflow (dir, block, b, name, inode_sector);
+          break;
+        }
+      if (!split_bucket (dir, idx, block, b))
+        break;
+    }
+
+ done:
+  free (b);
+  return success;
+}
+
+/* Returns the order in which hashed readdir returns NAME: its
+   hash with the bits reversed.  A bucket of local depth L holds
+   exactly the names whose keys share their top L bits, so each
+   bucket covers one range of keys, and splitting a bucket only
+   divides its range in two.  Returning entries in key order
+   therefore neither skips nor repeats a name when buckets split
+   between calls. */
+static uint32_t
+entry_key (const char *name) 
+{
+  uint32_t hash = hash_string (name);
+  uint32_t key = 0;
+  int i;
+
+  for (i = 0; i < 32; i++, hash >>= 1)
+    key = (key << 1) | (hash & 1);
+  return key;
+}
+
+/* Returns the bucket table index, at global depth DEPTH, of the
+   bucket that covers key KEY. */
+static uint32_t
+entry_key_index (uint32_t key, uint32_t depth) 
+{
+  uint32_t idx = 0;
+  uint32_t i;
+
+  for (i = 0; i < depth; i++)
+    idx |= ((key >> (31 - i)) & 1) << i;
+  return idx;
+}
+
+/* Returns true if the entry with key KEY and name NAME comes
+   after DIR's readdir position. */
+static bool
+after_position (const struct dir *dir, uint32_t key, const char *name) 
+{
+  return (!dir->started || key > dir->last_key
+          || (key == dir->last_key && strcmp (name, dir->last_name) > 0));
+}
+
+/* Reads the next entry in hashed directory DIR, in the same way
+   as dir_readdir().  DIR's lock is held for each step, so a
+   bucket is never seen half split. */
+static bool
+hashed_readdir (struct dir *dir, char name[NAME_MAX + 1]) 
+{
+  bool found;
+
+  inode_lock_dir (dir->inode);
+  found = hashed_next (dir, name);
+  inode_unlock_dir (dir->inode);
+  return found;
+}
+
+/* Reads the next entry in hashed directory DIR, as
+   hashed_readdir() does, but with DIR's lock already held by the
+   caller.  Entries come out in entry_key() order, starting from
+   the bucket that covers DIR's position. */
+static bool
+hashed_next (struct dir *dir, char name[NAME_MAX + 1]) 
+{
+  struct dir_bucket *b;
+  uint32_t key = dir->started ? dir->last_key : 0;
+  bool found = false;
+
+  b = malloc (sizeof *b);
+  if (b == NULL)
+    return false;
+
+  for (;;)
+    {
+      struct dir_entry best;
+      bool have_best = false;
+      uint32_t best_key = 0;
+      uint32_t depth, local_depth, block, span;
+      off_t ofs;
+      size_t i;
+
+      /* Find the bucket that covers KEY. */
+      if (!read_word (dir, offsetof (struct dir_header, depth), &depth)
+          || !table_ofs (dir, entry_key_index (key, depth), &ofs)
+          || !read_word (dir, ofs, &block)
+          || !read_block (dir, block, b))
+        break;
+      ASSERT (b->magic == BUCKET_MAGIC);
+
+      /* Take the first entry after the position in it and its
+         overflow chain. */
+      local_depth = b->depth;
+      for (;;) 
+        {
+          for (i = 0; i < BUCKET_ENTRY_CNT; i++) 
+            {
+              struct dir_entry *e = &b->entries[i];
+              uint32_t e_key;
+
+              if (!e->in_use || is_dot_entry (e->name))
+                continue;
+              e_key = entry_key (e->name);
+              if (after_position (dir, e_key, e->name)
+                  && (!have_best || e_key < best_key
+                      || (e_key == best_key
+                          && strcmp (e->name, best.name) < 0)))
+                {
+                  best = *e;
+                  best_key = e_key;
+                  have_best = true;
+                }
+            }
+          if (b->next == 0)
+            break;
+          if (!read_block (dir, b->next, b))
+            goto done;
+        }
+      if (have_best) 
+        {
+          dir->started = true;
+          dir->last_key = best_key;
+          strlcpy (dir->last_name, best.name, sizeof dir->last_name);
+          strlcpy (name, best.name, NAME_MAX + 1);
+          found = true;
+          break;
+        }
+
+      /* Move on to the start of the next bucket's range, unless
+         this one reaches the end of the keys. */
+      if (local_depth == 0)
+        break;
+      span = 1u << (32 - local_depth);
+      key = (key & ~(span - 1)) + span;
+      if (key == 0)
+        break;
+    }
+
+ done:
+  free (b);
+  return found;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
@@ -99,6 +722,9 @@ lookup (const struct dir *dir, const char *name,
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (dir->hashed)
+    return hashed_lookup (dir, name, ep, ofsp);
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
@@ -120,16 +746,27 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
+  block_sector_t sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  if (!dcache_lookup (dir_sector, name, &sector)) 
+    {
+      unsigned gen = dcache_generation ();
+
+      /* A bucket split moves entries without changing any name's
+         binding, so searching in the middle of one could cache a
+         miss for a name that exists. */
+      inode_lock_dir (dir->inode);
+      sector = lookup (dir, name, &e, NULL) ? e.inode_sector : DCACHE_NONE;
+      inode_unlock_dir (dir->inode);
+      dcache_insert (dir_sector, name, sector, gen);
+    }
 
+  *inode = sector != DCACHE_NONE ? inode_open (sector) : NULL;
   return *inode != NULL;
 }
 
@@ -153,10 +790,23 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  /* Keep other changes out until NAME is in place. */
+  inode_lock_dir (dir->inode);
+
+  /* A removed directory cannot gain entries. */
+  if (inode_is_removed (dir->inode))
+    goto done;
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  if (dir->hashed) 
+    {
+      success = hashed_add (dir, name, inode_sector);
+      goto done;
+    }
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
@@ -176,6 +826,9 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  if (success)
+    dcache_update (inode_get_inumber (dir->inode), name, inode_sector);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -187,12 +840,19 @@ dir_remove (struct dir *dir, const char *name)
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  /* A directory's "." and ".." entries cannot be removed. */
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+
+  inode_lock_dir (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -202,17 +862,32 @@ dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
+  /* Only an empty directory may be removed.  Holding its lock
+     too (always parent before child) keeps dir_add() from
+     filling it between the check and the removal. */
+  if (inode_is_dir (inode)) 
+    {
+      inode_lock_dir (inode);
+      locked = true;
+      if (!is_empty (inode))
+        goto done;
+    }
+
   /* Erase directory entry. */
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
 
   /* Remove inode. */
+  dcache_update (inode_get_inumber (dir->inode), name, DCACHE_NONE);
   inode_remove (inode);
   success = true;
 
  done:
+  if (locked)
+    inode_unlock_dir (inode);
   inode_close (inode);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -224,10 +899,13 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
 
+  if (dir->hashed)
+    return hashed_readdir (dir, name);
+
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
       dir->pos += sizeof e;
-      if (e.in_use)
+      if (e.in_use && !is_dot_entry (e.name))
         {
           strlcpy (name, e.name, NAME_MAX + 1);
           return true;
@@ -235,3 +913,29 @@ dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
     }
   return false;
 }
+
+/* Returns true if NAME is "." or "..", which every directory
+   made by filesys_mkdir() contains but dir_readdir() does not
+   report. */
+static bool
+is_dot_entry (const char *name) 
+{
+  return !strcmp (name, ".") || !strcmp (name, "..");
+}
+
+/* Returns true if directory INODE has no entries other than "."
+   and "..".  The caller must hold INODE's directory lock. */
+static bool
+is_empty (struct inode *inode) 
+{
+  struct dir *dir = dir_open (inode_reopen (inode));
+  char name[NAME_MAX + 1];
+  bool empty;
+
+  if (dir == NULL)
+    return false;
+  empty = !(dir->hashed ? hashed_next (dir, name)
+            : dir_readdir (dir, name));
+  dir_close (dir);
+  return empty;
+}
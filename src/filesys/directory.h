@@ -11,6 +11,14 @@
    retained, but much longer full path names must be allowed. */
 #define NAME_MAX 14
 
+/* Most sectors that one dir_add() or dir_remove() changes through
+   the journal: the header, up to 4 bucket table blocks, the bucket
+   and a new one for each of up to 9 splits, an overflow bucket
+   once the bucket can split no further, and the directory's inode
+   and the index blocks for the blocks it appends, which never
+   span more than two leaves. */
+#define DIR_JOURNAL_SECTORS 20
+
 struct inode;
 
 /* Opening and closing directories. */
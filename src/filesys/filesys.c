@@ -2,15 +2,24 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
 static void do_format (void);
+static struct dir *resolve (const char *path, char name[NAME_MAX + 1]);
+static struct inode *lookup_inode (struct dir *, const char *name);
+static bool is_dot_name (const char *name);
+static bool add_dot_entries (block_sector_t sector, block_sector_t parent);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -21,12 +30,16 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  cache_init ();
   inode_init ();
+  file_init ();
+  dcache_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
 
+  journal_open ();
   free_map_open ();
 }
 
@@ -35,68 +48,260 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
+  journal_done ();
   free_map_close ();
+  cache_done ();
 }
 
-/* Creates a file named NAME with the given INITIAL_SIZE.
+/* Creates a file at PATH with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
-   Fails if a file named NAME already exists,
-   or if internal memory allocation fails. */
+   Fails if a file at PATH already exists, if a directory in
+   PATH does not exist, or if internal memory allocation fails. */
 bool
-filesys_create (const char *name, off_t initial_size) 
+filesys_create (const char *path, off_t initial_size) 
 {
+  char name[NAME_MAX + 1];
   block_sector_t inode_sector = 0;
-  struct dir *dir = dir_open_root ();
-  bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size, false)
-                  && dir_add (dir, name, inode_sector));
+  struct dir *dir;
+  bool success;
+
+  journal_begin (1 + DIR_JOURNAL_SECTORS);
+  dir = resolve (path, name);
+  success = (dir != NULL
+             && !is_dot_name (name)
+             && free_map_allocate (1, &inode_sector)
+             && inode_create (inode_sector, initial_size, false)
+             && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
+
+  return success;
+}
+
+/* Creates a directory at PATH.
+   Returns true if successful, false otherwise.
+   Fails for the same reasons as filesys_create(). */
+bool
+filesys_mkdir (const char *path) 
+{
+  char name[NAME_MAX + 1];
+  block_sector_t inode_sector = 0;
+  struct dir *dir;
+  bool created = false;
+  bool success;
+
+  /* The new directory's inode, header, table and single bucket,
+     which its inode maps directly, along with its parent's
+     changes. */
+  journal_begin (4 + DIR_JOURNAL_SECTORS);
+  dir = resolve (path, name);
+  success = (dir != NULL
+             && !is_dot_name (name)
+             && free_map_allocate (1, &inode_sector)
+             && (created = dir_create (inode_sector, 16))
+             && add_dot_entries (inode_sector,
+                                 inode_get_inumber (dir_get_inode (dir)))
+             && dir_add (dir, name, inode_sector));
+  if (!success && inode_sector != 0) 
+    {
+      /* Once dir_create() succeeds the new directory owns its
+         header, table, and bucket blocks, so removing its inode
+         is the only way to give them all back. */
+      struct inode *inode = created ? inode_open (inode_sector) : NULL;
+      if (inode != NULL)
+        {
+          inode_remove (inode);
+          inode_close (inode);
+        }
+      else
+        free_map_release (inode_sector, 1);
+    }
+  dir_close (dir);
+  journal_end ();
 
   return success;
 }
 
-/* Opens the file with the given NAME.
+/* Opens the file or directory at PATH.
    Returns the new file if successful or a null pointer
    otherwise.
-   Fails if no file named NAME exists,
+   Fails if nothing exists at PATH,
    or if an internal memory allocation fails. */
 struct file *
-filesys_open (const char *name)
+filesys_open (const char *path)
 {
-  struct dir *dir = dir_open_root ();
+  char name[NAME_MAX + 1];
+  struct dir *dir = resolve (path, name);
   struct inode *inode = NULL;
 
   if (dir != NULL)
-    dir_lookup (dir, name, &inode);
+    inode = lookup_inode (dir, name);
   dir_close (dir);
 
   return file_open (inode);
 }
 
-/* Deletes the file named NAME.
+/* Deletes the file or empty directory at PATH.
    Returns true if successful, false on failure.
-   Fails if no file named NAME exists,
-   or if an internal memory allocation fails. */
+   Fails if nothing exists at PATH, if PATH is a directory that
+   is not empty, or if an internal memory allocation fails. */
 bool
-filesys_remove (const char *name) 
+filesys_remove (const char *path) 
 {
-  struct dir *dir = dir_open_root ();
-  bool success = dir != NULL && dir_remove (dir, name);
+  char name[NAME_MAX + 1];
+  struct dir *dir;
+  bool success;
+
+  journal_begin (DIR_JOURNAL_SECTORS);
+  dir = resolve (path, name);
+  success = dir != NULL && dir_remove (dir, name);
   dir_close (dir); 
+  journal_end ();
 
   return success;
 }
-
+
+/* Makes the directory at PATH the current thread's working
+   directory.  Returns true if successful, false if PATH does not
+   name a directory. */
+bool
+filesys_chdir (const char *path) 
+{
+  struct thread *t = thread_current ();
+  char name[NAME_MAX + 1];
+  struct dir *dir = resolve (path, name);
+  struct inode *inode = NULL;
+  struct dir *cwd;
+
+  if (dir != NULL)
+    inode = lookup_inode (dir, name);
+  dir_close (dir);
+  if (inode == NULL || !inode_is_dir (inode)) 
+    {
+      inode_close (inode);
+      return false;
+    }
+
+  cwd = dir_open (inode);
+  if (cwd == NULL)
+    return false;
+  dir_close (t->cwd);
+  t->cwd = cwd;
+  return true;
+}
+
+/* Resolves PATH, which is relative to the current thread's
+   working directory unless it begins with "/".  Returns the
+   directory that should contain PATH's last component, which
+   is copied into NAME, or a null pointer if PATH is empty, if a
+   component is too long, or if a directory along the way does
+   not exist.  A PATH of "/" or one that ends in "/" yields NAME
+   ".".  The caller must close the returned directory. */
+static struct dir *
+resolve (const char *path, char name[NAME_MAX + 1]) 
+{
+  struct thread *t = thread_current ();
+  struct dir *dir;
+  char *copy, *token, *next, *save_ptr;
+  size_t size = strlen (path) + 1;
+
+  if (*path == '\0')
+    return NULL;
+  copy = malloc (size);
+  if (copy == NULL)
+    return NULL;
+  strlcpy (copy, path, size);
+
+  if (*path == '/' || t->cwd == NULL)
+    dir = dir_open_root ();
+  else
+    dir = dir_reopen (t->cwd);
+  strlcpy (name, ".", NAME_MAX + 1);
+
+  for (token = strtok_r (copy, "/", &save_ptr); token != NULL && dir != NULL;
+       token = next)
+    {
+      struct inode *inode;
+
+      next = strtok_r (NULL, "/", &save_ptr);
+      if (strlen (token) > NAME_MAX) 
+        {
+          dir_close (dir);
+          dir = NULL;
+          break;
+        }
+      if (next == NULL) 
+        {
+          strlcpy (name, token, NAME_MAX + 1);
+          break;
+        }
+
+      /* Step into the directory named TOKEN. */
+      inode = lookup_inode (dir, token);
+      dir_close (dir);
+      if (inode != NULL && inode_is_dir (inode))
+        dir = dir_open (inode);
+      else 
+        {
+          inode_close (inode);
+          dir = NULL;
+        }
+    }
+
+  free (copy);
+  return dir;
+}
+
+/* Looks up NAME in DIR and returns its inode, or a null pointer
+   if it does not exist.  The caller must close the inode. */
+static struct inode *
+lookup_inode (struct dir *dir, const char *name) 
+{
+  struct inode *inode = NULL;
+
+  if (!strcmp (name, "."))
+    return inode_reopen (dir_get_inode (dir));
+
+  /* A root directory formatted before directories had "." and
+     ".." entries is its own parent. */
+  if (!dir_lookup (dir, name, &inode) && !strcmp (name, ".."))
+    inode = inode_reopen (dir_get_inode (dir));
+  return inode;
+}
+
+/* Returns true if NAME is "." or "..", which cannot be created
+   or removed. */
+static bool
+is_dot_name (const char *name) 
+{
+  return !strcmp (name, ".") || !strcmp (name, "..");
+}
+
+/* Adds "." and ".." entries to the new directory in SECTOR,
+   whose parent directory is in PARENT.  Returns true if
+   successful, false on failure. */
+static bool
+add_dot_entries (block_sector_t sector, block_sector_t parent) 
+{
+  struct dir *dir = dir_open (inode_open (sector));
+  bool success = (dir != NULL
+                  && dir_add (dir, ".", sector)
+                  && dir_add (dir, "..", parent));
+  dir_close (dir);
+  return success;
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_create ();
   free_map_create ();
-  if (!dir_create (ROOT_DIR_SECTOR, 16))
+  if (!dir_create (ROOT_DIR_SECTOR, 16)
+      || !add_dot_entries (ROOT_DIR_SECTOR, ROOT_DIR_SECTOR))
     PANIC ("root directory creation failed");
   free_map_close ();
   printf ("done.\n");
@@ -1,85 +1,489 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <list.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Free map.
+
+   The free map file on disk holds one bit per sector.  In
+   memory, the same bitmap is kept along with an index of the
+   free extents, that is, maximal runs of free sectors, in a list
+   sorted by starting sector.  Allocation is next-fit: the search
+   starts at the extent where the previous allocation was made
+   (the "rover"), so that successive allocations, as when a file
+   grows, come out contiguous and the search does not rescan the
+   full extents at the start of the disk every time.
+
+   Changing the bitmap only marks the sectors of the free map
+   file that hold the changed bits as dirty.  free_map_flush()
+   writes just those sectors, and is called whenever the journal
+   commits and when the free map is closed.
+
+   Released sectors are not reused until free_map_commit() is
+   called, after the journal has committed the release.  Until
+   then, a crash could bring back the file that owned them, so
+   they must not be overwritten. */
+
+/* Number of free map bits in one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* A run of free sectors. */
+struct free_extent
+  {
+    struct list_elem elem;              /* Element in extents. */
+    block_sector_t start;               /* First sector. */
+    size_t length;                      /* Number of sectors. */
+  };
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct list extents;          /* Free extents, in sector order. */
+static struct list_elem *rover;      /* Next-fit hint, in extents. */
+static struct list pending;          /* Released, not yet reusable. */
+static struct lock free_map_lock;    /* Protects all of the above. */
+
+static struct bitmap *dirty_map;     /* Dirty sectors of free_map_file. */
+static struct lock flush_lock;       /* Serializes free_map_flush(). */
+
+static void build_extents (void);
+static void add_extent (block_sector_t, size_t);
+static void mark_dirty (block_sector_t, size_t);
 
 /* Initializes the free map. */
 void
-free_map_init (void) 
+free_map_init (void)
 {
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  list_init (&extents);
+  list_init (&pending);
+  lock_init (&free_map_lock);
+  lock_init (&flush_lock);
+
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  build_extents ();
+}
+
+/* Removes the first CNT sectors from extent X, which must have
+   at least that many, and moves the rover to X.  The caller must
+   hold free_map_lock. */
+static void
+take_front (struct free_extent *x, size_t cnt)
+{
+  ASSERT (x->length >= cnt);
+  x->start += cnt;
+  x->length -= cnt;
+  rover = &x->elem;
+  if (x->length == 0)
+    {
+      rover = list_remove (&x->elem);
+      free (x);
+    }
+}
+
+/* Marks the CNT sectors starting at SECTOR as in use in the
+   bitmap.  The caller must hold free_map_lock. */
+static void
+mark_used (block_sector_t sector, size_t cnt)
+{
+  ASSERT (bitmap_none (free_map, sector, cnt));
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  mark_dirty (sector, cnt);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  struct list_elem *start, *e;
+  bool success = false;
+
+  lock_acquire (&free_map_lock);
+  if (!list_empty (&extents))
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      /* Search from the rover, wrapping around at the end. */
+      start = rover != NULL && rover != list_end (&extents)
+              ? rover : list_begin (&extents);
+      e = start;
+      do
+        {
+          struct free_extent *x = list_entry (e, struct free_extent, elem);
+          if (x->length >= cnt)
+            {
+              *sectorp = x->start;
+              take_front (x, cnt);
+              mark_used (*sectorp, cnt);
+              success = true;
+              break;
+            }
+          e = list_next (e);
+          if (e == list_end (&extents))
+            e = list_begin (&extents);
+        }
+      while (e != start);
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
-  return sector != BITMAP_ERROR;
+  lock_release (&free_map_lock);
+
+  return success;
+}
+
+/* Allocates the CNT consecutive sectors starting at SECTOR, for
+   growing a run of sectors in place.
+   Returns true if successful, false if any of those sectors is
+   in use or memory is not available. */
+bool
+free_map_allocate_at (block_sector_t sector, size_t cnt)
+{
+  struct list_elem *e;
+  bool success = false;
+
+  lock_acquire (&free_map_lock);
+  if (sector + cnt > bitmap_size (free_map)
+      || !bitmap_none (free_map, sector, cnt))
+    goto done;
+
+  /* Find the extent that holds the sectors and carve them out of
+     it.  A file growing in place asks for the sectors just after
+     its previous allocation, which take_front() left the rover
+     pointing to, so try that extent before searching them all. */
+  e = list_begin (&extents);
+  if (rover != NULL && rover != list_end (&extents))
+    {
+      struct free_extent *x = list_entry (rover, struct free_extent, elem);
+      if (x->start <= sector)
+        e = rover;
+    }
+  for (; e != list_end (&extents); e = list_next (e))
+    {
+      struct free_extent *x = list_entry (e, struct free_extent, elem);
+      if (x->start + x->length <= sector)
+        continue;
+      if (x->start > sector || x->start + x->length < sector + cnt)
+        break;
+
+      if (sector == x->start)
+        take_front (x, cnt);
+      else if (sector + cnt == x->start + x->length)
+        {
+          x->length -= cnt;
+          rover = list_next (&x->elem);
+        }
+      else
+        {
+          /* Split X around the sectors. */
+          struct free_extent *tail = malloc (sizeof *tail);
+          if (tail == NULL)
+            goto done;
+          tail->start = sector + cnt;
+          tail->length = x->start + x->length - tail->start;
+          x->length = sector - x->start;
+          list_insert (list_next (&x->elem), &tail->elem);
+          rover = &tail->elem;
+        }
+      mark_used (sector, cnt);
+      success = true;
+      break;
+    }
+
+ done:
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Sets aside a run of up to CNT free sectors for a file to grow
+   into, storing the first into *SECTORP and the number into
+   *CNTP.  The run comes from the first extent at or after the
+   rover with room for all CNT, or else from the largest extent,
+   so that a file does not start on a fragment that another file
+   will soon grow into.  The sectors stay free in the bitmap, so
+   nothing needs to be written if they are never used, but no
+   one else can allocate them until free_map_unreserve().
+   Returns false if no sectors are free. */
+bool
+free_map_reserve (size_t cnt, block_sector_t *sectorp, size_t *cntp)
+{
+  struct free_extent *best = NULL;
+  struct list_elem *start, *e;
+
+  lock_acquire (&free_map_lock);
+  if (!list_empty (&extents))
+    {
+      start = rover != NULL && rover != list_end (&extents)
+              ? rover : list_begin (&extents);
+      e = start;
+      do
+        {
+          struct free_extent *x = list_entry (e, struct free_extent, elem);
+          if (best == NULL || x->length > best->length
+              || x->length >= cnt)
+            best = x;
+          if (x->length >= cnt)
+            break;
+          e = list_next (e);
+          if (e == list_end (&extents))
+            e = list_begin (&extents);
+        }
+      while (e != start);
+    }
+  if (best != NULL)
+    {
+      *sectorp = best->start;
+      *cntp = best->length < cnt ? best->length : cnt;
+      take_front (best, *cntp);
+    }
+  lock_release (&free_map_lock);
+
+  return best != NULL;
+}
+
+/* Allocates the CNT sectors starting at SECTOR, which must have
+   been set aside by free_map_reserve(). */
+void
+free_map_claim (block_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  mark_used (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Returns the CNT sectors starting at SECTOR, which were set
+   aside by free_map_reserve() and never claimed, to the free
+   extents. */
+void
+free_map_unreserve (block_sector_t sector, size_t cnt)
+{
+  if (cnt == 0)
+    return;
+  lock_acquire (&free_map_lock);
+  add_extent (sector, cnt);
+  lock_release (&free_map_lock);
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Makes CNT sectors starting at SECTOR available for use, once
+   free_map_commit() is called. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  struct free_extent *x;
+
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);
+
+  /* Without memory to remember them, the sectors are not reused
+     until the free map is read in again. */
+  x = malloc (sizeof *x);
+  if (x != NULL)
+    {
+      x->start = sector;
+      x->length = cnt;
+      list_push_back (&pending, &x->elem);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Makes the sectors released so far available for allocation. */
+void
+free_map_commit (void)
+{
+  lock_acquire (&free_map_lock);
+  while (!list_empty (&pending))
+    {
+      struct free_extent *x = list_entry (list_pop_front (&pending),
+                                          struct free_extent, elem);
+      add_extent (x->start, x->length);
+      free (x);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Adds the CNT free sectors starting at SECTOR to the extents,
+   merging them with the extents next to them.  The caller must
+   hold free_map_lock. */
+static void
+add_extent (block_sector_t sector, size_t cnt)
+{
+  struct free_extent *prev = NULL, *next = NULL;
+  struct list_elem *e;
+
+  /* Find the free extents just before and after the sectors. */
+  for (e = list_begin (&extents); e != list_end (&extents);
+       e = list_next (e))
+    {
+      struct free_extent *x = list_entry (e, struct free_extent, elem);
+      if (x->start > sector)
+        {
+          next = x;
+          break;
+        }
+      prev = x;
+    }
+
+  /* Merge with them where they are adjacent. */
+  if (prev != NULL && prev->start + prev->length == sector)
+    {
+      prev->length += cnt;
+      if (next != NULL && sector + cnt == next->start)
+        {
+          prev->length += next->length;
+          if (rover == &next->elem)
+            rover = &prev->elem;
+          list_remove (&next->elem);
+          free (next);
+        }
+    }
+  else if (next != NULL && sector + cnt == next->start)
+    {
+      next->start = sector;
+      next->length += cnt;
+    }
+  else
+    {
+      /* If memory is not available, the sectors stay free in the
+         bitmap but cannot be allocated until the free map is
+         read in again. */
+      struct free_extent *x = malloc (sizeof *x);
+      if (x != NULL)
+        {
+          x->start = sector;
+          x->length = cnt;
+          list_insert (next != NULL ? &next->elem : list_end (&extents),
+                       &x->elem);
+        }
+    }
+}
+
+/* Writes the sectors of the free map file that hold bits changed
+   since the last flush. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  /* There is nothing to write to before free_map_create() or
+     free_map_open() or after free_map_close(). */
+  lock_acquire (&flush_lock);
+  for (i = 0; free_map_file != NULL && i < bitmap_size (dirty_map); i++)
+    {
+      bool dirty;
+
+      /* Clear the dirty bit before writing, so that a change made
+         during the write marks the sector dirty again. */
+      lock_acquire (&free_map_lock);
+      dirty = bitmap_test (dirty_map, i);
+      bitmap_reset (dirty_map, i);
+      lock_release (&free_map_lock);
+
+      if (dirty && !bitmap_write_part (free_map, free_map_file,
+                                       i * BLOCK_SECTOR_SIZE,
+                                       BLOCK_SECTOR_SIZE))
+        {
+          lock_acquire (&free_map_lock);
+          bitmap_mark (dirty_map, i);
+          lock_release (&free_map_lock);
+        }
+    }
+  lock_release (&flush_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
-free_map_open (void) 
+free_map_open (void)
 {
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (dirty_map, false);
+  build_extents ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
-free_map_close (void) 
+free_map_close (void)
 {
+  free_map_flush ();
+  lock_acquire (&flush_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&flush_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void
-free_map_create (void) 
+free_map_create (void)
 {
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
+  /* Write bitmap to file.  Writing allocates the file's sectors,
+     which may change bits already written, so the dirty bits are
+     cleared first and the next flush rewrites those parts. */
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  bitmap_set_all (dirty_map, false);
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
+
+/* Rebuilds the list of free extents from the bitmap. */
+static void
+build_extents (void)
+{
+  size_t start, end;
+
+  lock_acquire (&free_map_lock);
+  while (!list_empty (&extents))
+    free (list_entry (list_pop_front (&extents), struct free_extent, elem));
+  while (!list_empty (&pending))
+    free (list_entry (list_pop_front (&pending), struct free_extent, elem));
+
+  for (start = bitmap_scan (free_map, 0, 1, false); start != BITMAP_ERROR;
+       start = bitmap_scan (free_map, end, 1, false))
+    {
+      struct free_extent *x = malloc (sizeof *x);
+      if (x == NULL)
+        PANIC ("can't index free map");
+
+      end = bitmap_scan (free_map, start, 1, true);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (free_map);
+      x->start = start;
+      x->length = end - start;
+      list_push_back (&extents, &x->elem);
+    }
+  rover = list_begin (&extents);
+  lock_release (&free_map_lock);
+}
+
+/* Marks the sectors of the free map file that hold the bits for
+   the CNT sectors starting at SECTOR as dirty.  The caller must
+   hold free_map_lock. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
@@ -3,16 +3,45 @@
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 #define DIRECT_BLOCK_NUMBER 10
 #define INDIRECT_BLOCK_NUMBER 128
 #define DOUBLE_INDIRECT_BLOCK_NUMBER 16384
+#define INODE_EXTENT_CNT 8
 
+/* Fewest sectors set aside at once for a growing inode, so that
+   a file written a little at a time still gets long extents. */
+#define RESERVE_MIN 16
+
+/* A run of LENGTH contiguous sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;               /* First sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+/* On-disk inode.
+   The first sectors of a file are mapped by up to
+   INODE_EXTENT_CNT extents, which are grown with contiguous
+   allocations.  Once every extent is in use, or if the file was
+   created before extents existed, the remaining sectors are
+   mapped through BLOCKS: 10 direct pointers, an indirect block,
+   and a double-indirect block, indexed from the end of the last
+   extent.
+   Files are sparse: sectors are allocated only when first
+   written, and a 0 entry in BLOCKS or in an index block is a
+   hole that reads as zeros.
+   Inodes, index blocks, and the data of directories are written
+   through the journal, in the same transaction as the free map
+   changes that go with them. */
 struct inode_disk
   {
     block_sector_t blocks[DIRECT_BLOCK_NUMBER + 2]; 
@@ -20,7 +49,9 @@ struct inode_disk
 
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[113];               /* Not used. */
+    uint32_t extent_cnt;                /* Number of extents in use. */
+    struct extent extents[INODE_EXTENT_CNT];  /* Leading extents. */
+    uint32_t unused[96];                /* Not used. */
   };
 
 struct indirect_block
@@ -28,11 +59,6 @@ struct indirect_block
   block_sector_t blocks[INDIRECT_BLOCK_NUMBER];
 };
 
-struct double_indirect_block
-{
-  struct indirect_block* blocks[INDIRECT_BLOCK_NUMBER];
-};
-
 struct inode 
   {
     struct list_elem elem;              /* Element in inode list. */
@@ -40,174 +66,392 @@ struct inode
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    bool metadata;                      /* Data written through journal? */
     struct inode_disk data;             /* Inode content. */
+
+    /* Held for reading by threads reading or writing within the
+       file, and for writing by a thread extending the inode, so
+       that reads proceed in parallel while changes to the length
+       are serialized. */
+    struct rwlock rwlock;
+
+    /* In-memory copies of index blocks, read in on first use so
+       that translating a byte offset does not have to read them
+       again.  Freed by invalidate_index_cache() whenever the
+       inode's block map changes. */
+    struct indirect_block *indirect;    /* Indirect block, or null. */
+    struct indirect_block *dbl_indirect;  /* Double-indirect block, or null. */
+    struct indirect_block *dbl_leaf;    /* One of its leaves, or null. */
+    size_t dbl_leaf_idx;                /* Which leaf dbl_leaf is. */
+    struct lock index_lock;             /* Protects block map and copies. */
+
+    /* Free sectors set aside by free_map_reserve() for the inode
+       to grow into, so that two files growing at once do not
+       interleave their sectors.  Protected by index_lock and
+       given back on the last close. */
+    block_sector_t reserve_start;       /* First reserved sector. */
+    size_t reserve_cnt;                 /* Number of reserved sectors. */
+
+    /* Held by directory code across a lookup and the change that
+       depends on it, so that adding or removing one entry is never
+       interleaved with another change to the same directory. */
+    struct lock dir_lock;
   };
 
-static inline size_t
-bytes_to_sectors (off_t size)
+/* Returns a malloc()'d copy of index block SECTOR, or a null
+   pointer if memory allocation fails. */
+static struct indirect_block *
+read_index_block (block_sector_t sector)
 {
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+  struct indirect_block *ib = malloc (sizeof *ib);
+  if (ib != NULL)
+    cache_read (sector, ib);
+  return ib;
 }
 
-static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+/* Discards INODE's in-memory copies of its index blocks. */
+static void
+invalidate_index_cache (struct inode *inode)
 {
-  ASSERT (inode != NULL); 
-  if (pos < inode->data.length)
-  {
-    //How many sectors will be needed
-    off_t sector_index = pos / BLOCK_SECTOR_SIZE;    
-
-    //Direct blocks
-    if (sector_index < DIRECT_BLOCK_NUMBER)
-      return inode->data.blocks[sector_index];
-    
-    //Indirect block/Double indirect block
-    if (sector_index < DIRECT_BLOCK_NUMBER + INDIRECT_BLOCK_NUMBER)
+  free (inode->indirect);
+  free (inode->dbl_indirect);
+  free (inode->dbl_leaf);
+  inode->indirect = inode->dbl_indirect = inode->dbl_leaf = NULL;
+}
+
+static char zeros[BLOCK_SECTOR_SIZE];
+
+//If *SECTOR is 0, allocate an index block for it and zero it on disk
+static bool allocate_zeroed(block_sector_t* sector)
+{
+  if (*sector != 0)
+    return true;
+  if (!free_map_allocate(1, sector))
+    return false;
+  journal_write (*sector, zeros);
+  return true;
+}
+
+/* Makes *COPY an in-memory copy of the index block whose sector
+   is stored in *SLOT, an entry in PARENT, which is kept in sector
+   PARENT_SECTOR.  If *SLOT is a hole and CREATE is true, allocates
+   an empty index block for it and writes PARENT back.
+   Returns false if *SLOT is a hole and CREATE is false, or if
+   disk or memory allocation fails. */
+static bool
+load_index_block (block_sector_t *slot, struct indirect_block **copy,
+                  bool create, block_sector_t parent_sector,
+                  const void *parent)
+{
+  if (*copy != NULL)
+    return true;
+  if (*slot == 0)
     {
-      struct indirect_block *indirect_disk_inode;
-      indirect_disk_inode = calloc (1, sizeof (struct indirect_block));
-      block_read(fs_device, inode->data.blocks[DIRECT_BLOCK_NUMBER], indirect_disk_inode);
-      return indirect_disk_inode->blocks[sector_index - DIRECT_BLOCK_NUMBER];;
+      if (!create || !allocate_zeroed (slot))
+        return false;
+      journal_write (parent_sector, parent);
     }
-    else
-    {
-      struct indirect_block *indirect_disk_inode;
-      indirect_disk_inode = calloc (1, sizeof (struct indirect_block));
+  *copy = read_index_block (*slot);
+  return *copy != NULL;
+}
 
-      struct double_indirect_block *double_indirect_inode;
-      double_indirect_inode = calloc (1, sizeof (struct double_indirect_block));
+/* Returns a pointer to the entry in INODE's BLOCKS map for the
+   SECTOR_INDEX'th sector past the end of its extents, reading
+   index blocks into memory as needed.  The block that holds the
+   entry, and the sector it is kept in, are stored into *BLOCK and
+   *BLOCK_SECTOR, so that the caller can write it back after
+   changing the entry.
+   If CREATE is true, missing index blocks are allocated.
+   Otherwise, or if disk or memory allocation fails, returns a
+   null pointer when an index block is missing.  Also returns a
+   null pointer if SECTOR_INDEX is beyond what BLOCKS can map.
+   The caller must hold INODE's index_lock. */
+static block_sector_t *
+find_slot (struct inode *inode, size_t sector_index, bool create,
+           void **block, block_sector_t *block_sector)
+{
+  struct inode_disk *data = &inode->data;
+  size_t leaf_idx;
 
-      sector_index -= INDIRECT_BLOCK_NUMBER + DIRECT_BLOCK_NUMBER;
+  //Direct blocks
+  if (sector_index < DIRECT_BLOCK_NUMBER)
+    {
+      *block = data;
+      *block_sector = inode->sector;
+      return &data->blocks[sector_index];
+    }
+  sector_index -= DIRECT_BLOCK_NUMBER;
 
-      block_read(fs_device, inode->data.blocks[DIRECT_BLOCK_NUMBER+1], double_indirect_inode);
-      block_read(fs_device, (block_sector_t)double_indirect_inode->blocks[sector_index/INDIRECT_BLOCK_NUMBER], indirect_disk_inode);
+  //Indirect block
+  if (sector_index < INDIRECT_BLOCK_NUMBER)
+    {
+      if (!load_index_block (&data->blocks[DIRECT_BLOCK_NUMBER],
+                             &inode->indirect, create, inode->sector, data))
+        return NULL;
+      *block = inode->indirect;
+      *block_sector = data->blocks[DIRECT_BLOCK_NUMBER];
+      return &inode->indirect->blocks[sector_index];
+    }
+  sector_index -= INDIRECT_BLOCK_NUMBER;
+  if (sector_index >= DOUBLE_INDIRECT_BLOCK_NUMBER)
+    return NULL;
 
-      return indirect_disk_inode->blocks[sector_index%INDIRECT_BLOCK_NUMBER];
+  //Double-indirect block, then the leaf block below it
+  if (!load_index_block (&data->blocks[DIRECT_BLOCK_NUMBER + 1],
+                         &inode->dbl_indirect, create, inode->sector, data))
+    return NULL;
+  leaf_idx = sector_index / INDIRECT_BLOCK_NUMBER;
+  if (inode->dbl_leaf != NULL && inode->dbl_leaf_idx != leaf_idx)
+    {
+      free (inode->dbl_leaf);
+      inode->dbl_leaf = NULL;
     }
-  }
-  
-  return -1;
+  inode->dbl_leaf_idx = leaf_idx;
+  if (!load_index_block (&inode->dbl_indirect->blocks[leaf_idx],
+                         &inode->dbl_leaf, create,
+                         data->blocks[DIRECT_BLOCK_NUMBER + 1],
+                         inode->dbl_indirect))
+    return NULL;
+  *block = inode->dbl_leaf;
+  *block_sector = inode->dbl_indirect->blocks[leaf_idx];
+  return &inode->dbl_leaf->blocks[sector_index % INDIRECT_BLOCK_NUMBER];
 }
 
-//Extend the given sector, treating it as an indirect block
-static bool create_indirect_block(block_sector_t* sector, size_t sector_count)
+//Number of sectors mapped by the extents of DISK_INODE
+static size_t extent_sectors(const struct inode_disk *disk_inode)
 {
-  struct indirect_block ib;
-  static char zeros[BLOCK_SECTOR_SIZE];
+  size_t sectors = 0;
   size_t i;
 
-  if (*sector == 0){
-    free_map_allocate(1, sector);
-    block_write(fs_device, *sector, zeros);
-  }
-  block_read(fs_device, *sector, &ib);
-
-  for (i=0; i<sector_count; i++)
-  {
-    block_sector_t* new_sector = &ib.blocks[i];
-    if (*new_sector == 0){
-      if (!free_map_allocate(1, new_sector))
-        return false;
-      block_write(fs_device, *new_sector, zeros);
-    }
-  }
-
-  block_write(fs_device, *sector, &ib);
-  return true;
+  for (i=0; i<disk_inode->extent_cnt; i++)
+    sectors += disk_inode->extents[i].length;
+  return sectors;
 }
 
-//Extend the given sector, treating it as an double-indirect block
-static bool create_double_indirect_block(block_sector_t* sector, size_t sector_count)
+//True if any sector is mapped through the BLOCKS map of DISK_INODE
+static bool blocks_in_use(const struct inode_disk *disk_inode)
 {
-  struct indirect_block ib;
-  static char zeros[BLOCK_SECTOR_SIZE];
-  size_t i, k;
+  size_t i;
 
-  if (*sector == 0){
-    free_map_allocate(1, sector);
-    block_write(fs_device, *sector, zeros);
-  }
-  block_read(fs_device, *sector, &ib);
+  for (i=0; i<DIRECT_BLOCK_NUMBER + 2; i++)
+    if (disk_inode->blocks[i] != 0)
+      return true;
+  return false;
+}
 
-  for (i=0; i<DIV_ROUND_UP(sector_count, INDIRECT_BLOCK_NUMBER); i++)
-  {
-    block_sector_t* new_sector = &ib.blocks[i];
-    struct indirect_block new_ib;
+/* Returns the block device sector that contains byte offset POS
+   within INODE.
+   Returns 0, which is never a data sector, if POS lies in a hole,
+   that is, a part of the file that has never been written and
+   reads as zeros.  The caller must hold INODE's index_lock. */
+static block_sector_t
+lookup_sector (struct inode *inode, off_t pos) 
+{
+  size_t sector_index;
+  size_t i;
+  block_sector_t *slot;
+  void *block;
+  block_sector_t block_sector;
 
-    if (*new_sector == 0){
-      free_map_allocate(1, new_sector);
-      block_write(fs_device, *new_sector, zeros);
-    }
-    block_read(fs_device, *new_sector, &new_ib);
+  ASSERT (inode != NULL); 
+  sector_index = pos / BLOCK_SECTOR_SIZE;
 
-    for (k=0; k<sector_count; k++)
+  //Extents
+  for (i = 0; i < inode->data.extent_cnt; i++)
     {
-      block_sector_t* direct_sector = &new_ib.blocks[k];
-      if (*direct_sector == 0){
-        if (!free_map_allocate(1, direct_sector))
-          return false;
-        block_write(fs_device, *direct_sector, zeros);
+      const struct extent *e = &inode->data.extents[i];
+      if (sector_index < e->length)
+        return e->start + sector_index;
+      sector_index -= e->length;
     }
 
-    block_write(fs_device, *new_sector, &new_ib);
-    }
-  }
+  slot = find_slot (inode, sector_index, false, &block, &block_sector);
+  return slot != NULL ? *slot : 0;
+}
+
+/* Returns the block device sector that contains byte offset POS
+   within INODE, as lookup_sector() does.  Threads that share
+   INODE's rwlock for reading may call this at the same time. */
+static block_sector_t
+byte_to_sector (struct inode *inode, off_t pos) 
+{
+  block_sector_t sector;
+
+  lock_acquire (&inode->index_lock);
+  sector = lookup_sector (inode, pos);
+  lock_release (&inode->index_lock);
+  return sector;
+}
 
-  block_write(fs_device, *sector, &ib);
+/* Writes SIZE bytes from BUFFER into data sector SECTOR of
+   INODE, starting at byte offset OFS within the sector. */
+static void
+write_data (struct inode *inode, block_sector_t sector, const void *buffer,
+            size_t ofs, size_t size)
+{
+  if (inode->metadata)
+    journal_write_at (sector, buffer, ofs, size);
+  else
+    cache_write_at (sector, buffer, ofs, size);
+}
+
+/* Allocates a sector for INODE from its reservation, first
+   reserving a run for the SECTOR_CNT sectors that the current
+   write still has to fill if the reservation is used up, and
+   stores it into *SECTOR.  Returns false if the disk is full.
+   The caller must hold INODE's index_lock. */
+static bool
+allocate_sector (struct inode *inode, size_t sector_cnt,
+                 block_sector_t *sector)
+{
+  if (inode->reserve_cnt == 0
+      && !free_map_reserve (sector_cnt > RESERVE_MIN
+                            ? sector_cnt : RESERVE_MIN,
+                            &inode->reserve_start, &inode->reserve_cnt))
+    return false;
+  *sector = inode->reserve_start++;
+  inode->reserve_cnt--;
+  free_map_claim (*sector, 1);
   return true;
 }
 
-//Given an inode_disk, extend it so that it can fit more data
-static bool extend_inode(struct inode_disk *disk_inode, size_t sectors)
+/* Writes the SIZE bytes at BUFFER at byte offset OFS within the
+   sector that holds byte offset POS in INODE, allocating that
+   sector first if POS lies in a hole.  SECTOR_CNT is the number
+   of sectors, this one included, that the write still has to
+   fill, so that the file can be given a run long enough for
+   them all.
+   A new sector is mapped only once it holds the data, with zeros
+   around it, so that a thread reading the hole at the same time
+   sees either zeros or the new data.  Sequential writes at the
+   end of the extents grow them, as long as BLOCKS is still
+   unused, because BLOCKS is indexed from the end of the extents.
+   Returns false if disk or memory allocation fails. */
+static bool
+write_sector (struct inode *inode, off_t pos, const void *buffer,
+              size_t ofs, size_t size, size_t sector_cnt)
 {
-  //Count up to direct blocks only
-  size_t iteration_count = (sectors < DIRECT_BLOCK_NUMBER) ? sectors : DIRECT_BLOCK_NUMBER;
+  struct inode_disk *data = &inode->data;
+  size_t sector_index = pos / BLOCK_SECTOR_SIZE;
+  size_t mapped;
+  block_sector_t sector;
+  struct extent *e = NULL;
+  block_sector_t *slot = NULL;
+  void *block = data;
+  block_sector_t block_sector = inode->sector;
+  bool success = false;
 
-  //Direct block
-  size_t k;
-  for (k=0; k<iteration_count; k++)
-  {
-    if (disk_inode->blocks[k] == 0)
+  sector = byte_to_sector (inode, pos);
+  if (sector != 0)
     {
-      if (free_map_allocate(1, &disk_inode->blocks[k]))
-      {
-        static char zeros[BLOCK_SECTOR_SIZE];
-        block_write(fs_device, disk_inode->blocks[k], zeros);
-      }
-      else
-        return false;
+      write_data (inode, sector, buffer, ofs, size);
+      return true;
+    }
+
+  lock_acquire (&inode->index_lock);
 
-    if (iteration_count == sectors && k == iteration_count)
+  /* Another thread may have filled the hole meanwhile. */
+  sector = lookup_sector (inode, pos);
+  if (sector != 0)
+    {
+      lock_release (&inode->index_lock);
+      write_data (inode, sector, buffer, ofs, size);
       return true;
     }
-  }
 
-  //Indirect block
-  sectors -= iteration_count;
-  iteration_count = (sectors < INDIRECT_BLOCK_NUMBER) ? sectors : INDIRECT_BLOCK_NUMBER;
-  if (!create_indirect_block(&disk_inode->blocks[DIRECT_BLOCK_NUMBER], iteration_count))
-    return false;
-  else if (sectors == iteration_count)
-    return true;
+  mapped = extent_sectors (data);
+  if (sector_index == mapped && !blocks_in_use (data))
+    {
+      /* Grow the last extent in place, from the reservation if
+         it lies just past the extent, or else start a new one. */
+      if (data->extent_cnt > 0)
+        {
+          e = &data->extents[data->extent_cnt - 1];
+          sector = e->start + e->length;
+          if (inode->reserve_cnt > 0 && inode->reserve_start == sector)
+            allocate_sector (inode, sector_cnt, &sector);
+          else if (!free_map_allocate_at (sector, 1))
+            e = NULL;
+        }
+      if (e == NULL && data->extent_cnt < INODE_EXTENT_CNT)
+        {
+          if (!allocate_sector (inode, sector_cnt, &sector))
+            goto done;
+          e = &data->extents[data->extent_cnt];
+        }
+    }
+  if (e == NULL)
+    {
+      slot = find_slot (inode, sector_index - mapped, true,
+                        &block, &block_sector);
+      if (slot == NULL || !allocate_sector (inode, sector_cnt, &sector))
+        goto done;
+    }
 
-  //Double-indirect block
-  sectors -= iteration_count;
-  iteration_count = (sectors < DOUBLE_INDIRECT_BLOCK_NUMBER) ? sectors : DOUBLE_INDIRECT_BLOCK_NUMBER;
-  if (! create_double_indirect_block(&disk_inode->blocks[DIRECT_BLOCK_NUMBER+1], iteration_count))
-    return false;
+  if (ofs != 0 || size != BLOCK_SECTOR_SIZE)
+    write_data (inode, sector, zeros, 0, BLOCK_SECTOR_SIZE);
+  write_data (inode, sector, buffer, ofs, size);
 
-  return true;
+  if (slot != NULL)
+    *slot = sector;
+  else if (e == &data->extents[data->extent_cnt])
+    {
+      e->start = sector;
+      e->length = 1;
+      data->extent_cnt++;
+    }
+  else
+    e->length++;
+  journal_write (block_sector, block);
+  success = true;
+
+ done:
+  lock_release (&inode->index_lock);
+  return success;
 }
 
-static void unextend_inode(struct inode *inode, size_t sectors)
+//Release indirect block SECTOR, and every sector it maps
+static void release_indirect_block(block_sector_t sector)
+{
+  struct indirect_block ib;
+  size_t i;
+
+  cache_read (sector, &ib);
+  for (i=0; i<INDIRECT_BLOCK_NUMBER; i++)
+    if (ib.blocks[i] != 0)
+      free_map_release(ib.blocks[i], 1);
+  free_map_release(sector, 1);
+}
+
+//Release every data and index sector of INODE, skipping holes
+static void unextend_inode(struct inode *inode)
 {
-  size_t num_sectors = (sectors < DIRECT_BLOCK_NUMBER) ? sectors : DIRECT_BLOCK_NUMBER;
   size_t k;
 
-  for (k=0; k<num_sectors; k++)
+  invalidate_index_cache(inode);
+
+  for (k=0; k<inode->data.extent_cnt; k++)
   {
-    free_map_release(inode->data.blocks[k], 1);
+    const struct extent *e = &inode->data.extents[k];
+    free_map_release(e->start, e->length);
+  }
+
+  for (k=0; k<DIRECT_BLOCK_NUMBER; k++)
+    if (inode->data.blocks[k] != 0)
+      free_map_release(inode->data.blocks[k], 1);
+
+  if (inode->data.blocks[DIRECT_BLOCK_NUMBER] != 0)
+    release_indirect_block(inode->data.blocks[DIRECT_BLOCK_NUMBER]);
+
+  if (inode->data.blocks[DIRECT_BLOCK_NUMBER+1] != 0)
+  {
+    struct indirect_block ib;
+
+    cache_read (inode->data.blocks[DIRECT_BLOCK_NUMBER+1], &ib);
+    for (k=0; k<INDIRECT_BLOCK_NUMBER; k++)
+      if (ib.blocks[k] != 0)
+        release_indirect_block(ib.blocks[k]);
+    free_map_release(inode->data.blocks[DIRECT_BLOCK_NUMBER+1], 1);
   }
 }
 
@@ -215,11 +459,18 @@ static void unextend_inode(struct inode *inode, size_t sectors)
    returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Cache of struct inode objects.  An inode holds a copy of its
+   on-disk inode, so malloc() would round it up to 1 kB. */
+static struct kmem_cache *inode_cache;
+
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
   list_init (&open_inodes);
+  inode_cache = kmem_cache_create ("inode", sizeof (struct inode), NULL);
+  if (inode_cache == NULL)
+    PANIC ("inode_init: out of memory");
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -238,20 +489,18 @@ inode_create (block_sector_t sector, off_t length, bool is_directory)
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+  /* The file starts out as one hole, so no data sectors are
+     allocated until they are written. */
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->is_directory = is_directory;
-      
-      if (extend_inode(disk_inode, sectors))
-      {
-        block_write(fs_device, sector, disk_inode);
-        success = true;
-      }
-
+      journal_begin (1);
+      journal_write (sector, disk_inode);
+      journal_end ();
+      success = true;
       free (disk_inode);
     }
   return success;
@@ -279,7 +528,7 @@ inode_open (block_sector_t sector)
     }
 
   /* Allocate memory. */
-  inode = malloc (sizeof *inode);
+  inode = kmem_cache_alloc (inode_cache);
   if (inode == NULL)
     return NULL;
 
@@ -289,7 +538,14 @@ inode_open (block_sector_t sector)
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read (fs_device, inode->sector, &inode->data);
+  inode->indirect = inode->dbl_indirect = inode->dbl_leaf = NULL;
+  lock_init (&inode->index_lock);
+  inode->reserve_cnt = 0;
+  lock_init (&inode->dir_lock);
+  rwlock_init (&inode->rwlock, RWLOCK_FAIR);
+  cache_read (inode->sector, &inode->data);
+  inode->metadata = (inode->data.is_directory
+                     || sector == FREE_MAP_SECTOR);
   return inode;
 }
 
@@ -324,15 +580,19 @@ inode_close (struct inode *inode)
     {
       /* Remove from inode list and release lock. */
       list_remove (&inode->elem);
+      free_map_unreserve (inode->reserve_start, inode->reserve_cnt);
  
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
+          journal_begin (0);
           free_map_release (inode->sector, 1);
-          unextend_inode(inode, bytes_to_sectors(inode->data.length)); 
+          unextend_inode(inode); 
+          journal_end ();
         }
 
-      free (inode); 
+      invalidate_index_cache (inode);
+      kmem_cache_free (inode_cache, inode);
     }
 }
 
@@ -347,14 +607,16 @@ inode_remove (struct inode *inode)
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   Holes read as zeros. */
 off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) 
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+  off_t next;
 
+  rwlock_acquire_read (&inode->rwlock);
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -371,73 +633,68 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          block_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          block_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      if (sector_idx != 0)
+        cache_read_at (sector_idx, buffer + bytes_read, sector_ofs,
+                       chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+
+  /* Start bringing in the sector after the last one read, on the
+     guess that the caller is reading sequentially. */
+  next = ROUND_UP (offset, BLOCK_SECTOR_SIZE);
+  if (bytes_read > 0 && next < inode_length (inode))
+    {
+      block_sector_t sector = byte_to_sector (inode, next);
+      if (sector != 0)
+        cache_readahead (sector);
+    }
+  rwlock_release_read (&inode->rwlock);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if an error occurs.  A write past end of file
+   extends the inode, leaving a hole between the old end of file
+   and OFFSET; only the sectors written are allocated. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
   off_t total_size = size + offset;
+  off_t length;
+  bool extending, written;
 
   if (inode->deny_write_cnt)
     return 0;
-  
-  if (byte_to_sector(inode, total_size) == -1u)
-  {
-    if (extend_inode(&inode->data, bytes_to_sectors(total_size)))
-    {
-      (&inode->data)->length = total_size;
-      block_write(fs_device, inode->sector, &inode->data);
-    }
-    else
-    {
-      return bytes_written;
-    }
-  }
+
+  /* Writing within the file only needs the inode shared, because
+     the cache serializes writes to each sector.  Files never
+     shrink, so a write found not to extend the file cannot come
+     to need extending once the lock is held. */
+  extending = total_size > inode_length (inode);
+  if (extending)
+    rwlock_acquire_write (&inode->rwlock);
+  else
+    rwlock_acquire_read (&inode->rwlock);
+  length = extending ? total_size : inode_length (inode);
 
   while (size > 0) 
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      /* Starting byte offset within sector. */
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -446,38 +703,41 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          block_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            block_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          block_write (fs_device, sector_idx, bounce);
-        }
+      /* Each sector is written in a handle of its own, so that a
+         long write never needs room in the journal for every
+         index block it touches at once.  Opening one with the
+         rwlock held is safe because a thread inside a handle
+         never waits for a file's rwlock: only directories are
+         locked inside handles, and they are only written inside
+         handles already open. */
+      journal_begin (INODE_JOURNAL_SECTORS);
+      written = write_sector (inode, offset, buffer + bytes_written,
+                              sector_ofs, chunk_size,
+                              DIV_ROUND_UP (sector_ofs + size,
+                                            BLOCK_SECTOR_SIZE));
+      journal_end ();
+      if (!written)
+        break;
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+
+  /* Extend the file only over what was actually written. */
+  if (offset > inode_length (inode))
+    {
+      journal_begin (1);
+      inode->data.length = offset;
+      journal_write (inode->sector, &inode->data);
+      journal_end ();
+    }
+
+  if (extending)
+    rwlock_release_write (&inode->rwlock);
+  else
+    rwlock_release_read (&inode->rwlock);
   return bytes_written;
 }
 
@@ -507,3 +767,31 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns true if INODE is a directory, false otherwise. */
+bool
+inode_is_dir (const struct inode *inode)
+{
+  return inode->data.is_directory;
+}
+
+/* Returns true if INODE has been removed, false otherwise. */
+bool
+inode_is_removed (const struct inode *inode)
+{
+  return inode->removed;
+}
+
+/* Acquires INODE's directory lock, waiting if necessary. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases INODE's directory lock. */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
@@ -7,6 +7,11 @@
 
 struct bitmap;
 
+/* Most sectors that writing one sector's worth of an inode's data
+   changes through the journal: the data sector, if the inode is
+   journaled, the index blocks that lead to it, and the inode. */
+#define INODE_JOURNAL_SECTORS 4
+
 void inode_init (void);
 bool inode_create (block_sector_t, off_t, bool is_directory);
 struct inode *inode_open (block_sector_t);
@@ -19,5 +24,9 @@ off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+bool inode_is_dir (const struct inode *);
+bool inode_is_removed (const struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,498 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <round.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata journal.
+
+   Inode sectors, index blocks, and the data of directories and
+   of the free map file are file system metadata.  Every change
+   to them is made inside a handle, that is, between
+   journal_begin() and journal_end(), with journal_write() or
+   journal_write_at() instead of the buffer cache's own write
+   functions.  The sectors written are collected into the running
+   transaction and held in the buffer cache, which does not write
+   them back until the transaction commits.  A sector is written
+   back before it is first held, so the disk always has its last
+   committed version.
+
+   journal_commit() waits for every open handle to end and
+   writes every dirty sector that is not held home, so that data
+   reaches disk before any metadata that refers to it.  It then
+   writes the transaction to the log: the free map's dirty
+   sectors, which go there straight from memory, descriptor
+   blocks listing the sectors, a copy of each other sector, and a
+   commit block.  Only then does it let the cache write the
+   sectors home.  Sectors freed in the transaction may be reused
+   only after that.  Because the free map's sectors never wait in
+   the buffer cache, the log is made big enough at format time to
+   hold all of them along with TXN_MAX others, however large the
+   disk.  Commits happen periodically, from the buffer cache's
+   write-behind thread, whenever a transaction fills up, and at
+   shutdown, so that any number of small updates share one
+   sequential write to the log.
+
+   Because every commit first writes all earlier changes home,
+   where nothing held can overwrite them, the log never holds
+   more than the latest transaction, which
+   always starts at the beginning of the log.  At startup,
+   journal_open() replays that transaction if its commit block
+   made it to disk, which is enough to bring the metadata back to
+   a consistent state after a crash.  Replaying a transaction
+   that was already written home is harmless.
+
+   The data of ordinary files is not journaled. */
+
+/* Identifies the journal header, descriptor and commit blocks. */
+#define JOURNAL_MAGIC 0x4c4e524a
+#define DESC_MAGIC 0x43534544
+#define COMMIT_MAGIC 0x54494d43
+
+/* Maximum number of sectors in a transaction, not counting the
+   free map's, which must leave enough of the buffer cache's 64
+   entries free for other use. */
+#define TXN_MAX 48
+
+/* Number of sectors listed in a descriptor block. */
+#define DESC_ENTRY_CNT 125
+
+/* First sector of the log. */
+#define LOG_SECTOR (JOURNAL_SECTOR + 1)
+
+/* On-disk journal header, in JOURNAL_SECTOR. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t log_cnt;                   /* Number of sectors in log. */
+    uint32_t desc_cnt;                  /* Descriptor blocks in log. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+/* Descriptor block.  The log starts with enough of these to list
+   every sector it can hold, DESC_ENTRY_CNT to a block; only as
+   many as a transaction needs are written. */
+struct journal_desc
+  {
+    uint32_t magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Number of sectors in all. */
+    block_sector_t sectors[DESC_ENTRY_CNT];  /* Home of logged sectors. */
+  };
+
+/* Commit block, just after the last logged sector. */
+struct journal_commit
+  {
+    uint32_t magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Same as in descriptor. */
+    uint32_t cnt;                       /* Same as in descriptor. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+static bool enabled;                    /* Journal in use? */
+static size_t desc_cnt;                 /* Descriptor blocks in log. */
+static size_t slot_cnt;                 /* Sectors the log can hold. */
+static uint32_t seq;                    /* Running transaction's number. */
+static block_sector_t *txn;             /* Sectors in running transaction. */
+static size_t txn_cnt;                  /* Number of sectors in txn. */
+static size_t free_map_cnt;             /* Free map sectors after txn's. */
+static bool logging_free_map;           /* Writing free map to log? */
+static int handle_cnt;                  /* Number of open handles. */
+static size_t reserved;                 /* Sectors handles may still add. */
+static bool committing;                 /* Commit in progress? */
+static struct lock journal_lock;        /* Protects all of the above. */
+static struct condition journal_idle;   /* Signaled on handle end, commit. */
+
+/* Scratch sector for commit and replay, which never overlap. */
+static uint8_t scratch[BLOCK_SECTOR_SIZE];
+
+static void commit (void);
+static void log_free_map (block_sector_t, const void *, size_t ofs,
+                          size_t size);
+
+/* Returns the sector of the log that holds the sector listed at
+   index I in the descriptor blocks. */
+static block_sector_t
+slot_sector (size_t i) 
+{
+  return LOG_SECTOR + desc_cnt + i;
+}
+
+/* Creates an empty journal while formatting the file system.
+   Must be called before anything else is allocated in the free
+   map.  Without room for the log, the file system is left
+   unjournaled. */
+void
+journal_create (void)
+{
+  struct journal_header *h = (struct journal_header *) scratch;
+  size_t free_map_sectors = DIV_ROUND_UP (block_size (fs_device),
+                                          BLOCK_SECTOR_SIZE * 8);
+
+  ASSERT (sizeof (struct journal_header) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_desc) == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct journal_commit) == BLOCK_SECTOR_SIZE);
+
+  slot_cnt = TXN_MAX + free_map_sectors;
+  desc_cnt = DIV_ROUND_UP (slot_cnt, DESC_ENTRY_CNT);
+  if (!free_map_allocate_at (JOURNAL_SECTOR, 1 + desc_cnt + slot_cnt + 1))
+    {
+      printf ("journal: no room for log, metadata will not be journaled\n");
+      return;
+    }
+
+  /* A log that starts with zeros holds no transaction.  The log
+     is always read and written directly, bypassing the cache. */
+  memset (scratch, 0, BLOCK_SECTOR_SIZE);
+  block_write (fs_device, LOG_SECTOR, scratch);
+
+  memset (h, 0, BLOCK_SECTOR_SIZE);
+  h->magic = JOURNAL_MAGIC;
+  h->log_cnt = desc_cnt + slot_cnt + 1;
+  h->desc_cnt = desc_cnt;
+  block_write (fs_device, JOURNAL_SECTOR, h);
+}
+
+/* Opens the journal and replays the transaction in the log, if
+   it was committed.  Must be called before the free map is read.
+   If the file system has no journal, writes go straight to the
+   buffer cache. */
+void
+journal_open (void) 
+{
+  struct journal_header *h = (struct journal_header *) scratch;
+  struct journal_desc desc;
+  struct journal_commit *c = (struct journal_commit *) scratch;
+  size_t cnt, i;
+
+  lock_init (&journal_lock);
+  cond_init (&journal_idle);
+  txn_cnt = 0;
+  handle_cnt = 0;
+  reserved = 0;
+  committing = false;
+  seq = 1;
+
+  block_read (fs_device, JOURNAL_SECTOR, h);
+  if (h->magic != JOURNAL_MAGIC)
+    {
+      printf ("journal: none found, metadata will not be journaled\n");
+      return;
+    }
+  desc_cnt = h->desc_cnt;
+  slot_cnt = h->log_cnt - desc_cnt - 1;
+  if (h->log_cnt <= desc_cnt + TXN_MAX
+      || desc_cnt != DIV_ROUND_UP (slot_cnt, DESC_ENTRY_CNT))
+    {
+      printf ("journal: bad header, metadata will not be journaled\n");
+      return;
+    }
+  txn = malloc (slot_cnt * sizeof *txn);
+  if (txn == NULL)
+    {
+      printf ("journal: out of memory, metadata will not be journaled\n");
+      return;
+    }
+
+  block_read (fs_device, LOG_SECTOR, &desc);
+  if (desc.magic == DESC_MAGIC && desc.cnt <= slot_cnt)
+    {
+      seq = desc.seq + 1;
+      cnt = desc.cnt;
+      block_read (fs_device, slot_sector (cnt), c);
+      if (c->magic == COMMIT_MAGIC && c->seq == desc.seq && c->cnt == cnt)
+        {
+          for (i = 0; i < cnt; i++)
+            {
+              if (i > 0 && i % DESC_ENTRY_CNT == 0)
+                block_read (fs_device, LOG_SECTOR + i / DESC_ENTRY_CNT,
+                            &desc);
+              block_read (fs_device, slot_sector (i), scratch);
+              cache_write (desc.sectors[i % DESC_ENTRY_CNT], scratch);
+            }
+          cache_flush ();
+        }
+    }
+  enabled = true;
+}
+
+/* Commits the running transaction and stops journaling, for
+   shutdown.  Later writes go straight to the buffer cache. */
+void
+journal_done (void) 
+{
+  if (!enabled)
+    return;
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&journal_idle, &journal_lock);
+  commit ();
+  enabled = false;
+  lock_release (&journal_lock);
+}
+
+/* Opens a handle, so that the metadata changes made before the
+   matching journal_end() commit together.  The handle may add up
+   to SECTOR_CNT sectors to the running transaction, which are set
+   aside for it now.  Handles nest, so an operation may call
+   others that open their own, but only the outermost handle's
+   SECTOR_CNT counts, so it must cover everything done inside it.
+   The outermost handle must be opened before acquiring any lock
+   that a thread inside a handle might wait for, because it waits
+   for a commit in progress to finish. */
+void
+journal_begin (size_t sector_cnt) 
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (sector_cnt <= TXN_MAX);
+
+  if (!enabled)
+    return;
+  if (t->journal_depth > 0)
+    {
+      t->journal_depth++;
+      return;
+    }
+
+  lock_acquire (&journal_lock);
+  for (;;)
+    {
+      if (committing)
+        cond_wait (&journal_idle, &journal_lock);
+      else if (txn_cnt + reserved + sector_cnt > TXN_MAX)
+        commit ();
+      else
+        break;
+    }
+  handle_cnt++;
+  reserved += sector_cnt;
+  t->journal_credits = sector_cnt;
+  t->journal_depth = 1;
+  lock_release (&journal_lock);
+}
+
+/* Closes a handle opened with journal_begin(). */
+void
+journal_end (void) 
+{
+  struct thread *t = thread_current ();
+
+  if (!enabled)
+    return;
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  reserved -= t->journal_credits;
+  t->journal_credits = 0;
+  if (--handle_cnt == 0)
+    cond_broadcast (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Writes BUFFER, which must contain BLOCK_SECTOR_SIZE bytes, to
+   metadata sector SECTOR as part of the running transaction. */
+void
+journal_write (block_sector_t sector, const void *buffer)
+{
+  journal_write_at (sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER into metadata sector SECTOR,
+   starting at byte offset OFS within the sector, as part of the
+   running transaction.  Must be called inside a handle, which
+   uses up one of the sectors set aside for it if SECTOR is new to
+   the transaction. */
+void
+journal_write_at (block_sector_t sector, const void *buffer,
+                  size_t ofs, size_t size)
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  if (!enabled)
+    {
+      cache_write_at (sector, buffer, ofs, size);
+      return;
+    }
+  ASSERT (t->journal_depth > 0);
+  if (logging_free_map)
+    {
+      log_free_map (sector, buffer, ofs, size);
+      return;
+    }
+
+  lock_acquire (&journal_lock);
+  for (i = 0; i < txn_cnt; i++)
+    if (txn[i] == sector)
+      break;
+  if (i == txn_cnt)
+    {
+      /* A handle that outgrows what it set aside may still use
+         sectors no other handle has claimed. */
+      if (t->journal_credits > 0)
+        {
+          t->journal_credits--;
+          reserved--;
+        }
+      else if (txn_cnt + reserved >= TXN_MAX)
+        PANIC ("journal handle overflow");
+      txn[txn_cnt++] = sector;
+    }
+  lock_release (&journal_lock);
+
+  cache_hold_at (sector, buffer, ofs, size);
+}
+
+/* Commits the running transaction, which also writes all dirty
+   sectors in the buffer cache to disk.  If the file system has
+   no journal, just writes out the free map and the buffer
+   cache. */
+void
+journal_commit (void) 
+{
+  if (!enabled)
+    {
+      free_map_flush ();
+      cache_flush ();
+      free_map_commit ();
+      return;
+    }
+
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&journal_idle, &journal_lock);
+  if (enabled)
+    commit ();
+  lock_release (&journal_lock);
+}
+
+/* Commits the running transaction, as described at the top of
+   this file.  New handles wait until the commit is done.  The
+   caller must hold journal_lock and must not have a handle
+   open. */
+static void
+commit (void) 
+{
+  struct thread *t = thread_current ();
+  struct journal_desc *desc = (struct journal_desc *) scratch;
+  struct journal_commit *c = (struct journal_commit *) scratch;
+  size_t cnt, i;
+
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+  ASSERT (t->journal_depth == 0);
+
+  committing = true;
+  while (handle_cnt > 0)
+    cond_wait (&journal_idle, &journal_lock);
+  lock_release (&journal_lock);
+
+  /* No one else can change the transaction now.  Once the last
+     transaction is all home, which makes the log free for reuse,
+     the free map's changes are written straight to the log,
+     after the slots for the sectors already in the transaction,
+     as though from a handle. */
+  cache_flush ();
+  free_map_cnt = 0;
+  logging_free_map = true;
+  t->journal_depth++;
+  free_map_flush ();
+  t->journal_depth--;
+  logging_free_map = false;
+
+  cnt = txn_cnt + free_map_cnt;
+  if (cnt > 0)
+    {
+      for (i = 0; i < cnt; i += DESC_ENTRY_CNT)
+        {
+          size_t n = cnt - i < DESC_ENTRY_CNT ? cnt - i : DESC_ENTRY_CNT;
+
+          memset (desc, 0, BLOCK_SECTOR_SIZE);
+          desc->magic = DESC_MAGIC;
+          desc->seq = seq;
+          desc->cnt = cnt;
+          memcpy (desc->sectors, txn + i, n * sizeof *txn);
+          block_write (fs_device, LOG_SECTOR + i / DESC_ENTRY_CNT, desc);
+        }
+
+      for (i = 0; i < txn_cnt; i++)
+        {
+          cache_read (txn[i], scratch);
+          block_write (fs_device, slot_sector (i), scratch);
+        }
+
+      /* Writes to the block device complete in order, so once the
+         commit block is on disk, so is the rest. */
+      memset (c, 0, BLOCK_SECTOR_SIZE);
+      c->magic = COMMIT_MAGIC;
+      c->seq = seq;
+      c->cnt = cnt;
+      block_write (fs_device, slot_sector (cnt), c);
+
+      for (i = 0; i < txn_cnt; i++)
+        cache_unhold (txn[i]);
+      for (; i < cnt; i++)
+        {
+          block_read (fs_device, slot_sector (i), scratch);
+          cache_write (txn[i], scratch);
+        }
+      seq++;
+    }
+  free_map_commit ();
+
+  lock_acquire (&journal_lock);
+  txn_cnt = 0;
+  committing = false;
+  cond_broadcast (&journal_idle, &journal_lock);
+}
+
+/* Writes SIZE bytes from BUFFER into free map sector SECTOR,
+   starting at byte offset OFS within the sector, in the log slot
+   that commit() has set aside for it.  The sector is not written
+   home until the commit block is on disk. */
+static void
+log_free_map (block_sector_t sector, const void *buffer, size_t ofs,
+              size_t size) 
+{
+  size_t i;
+
+  for (i = txn_cnt; i < txn_cnt + free_map_cnt; i++)
+    if (txn[i] == sector)
+      break;
+  if (i == txn_cnt + free_map_cnt)
+    {
+      ASSERT (i < slot_cnt);
+
+      /* Replaying the last transaction would now copy this
+         sector's slot somewhere it does not belong, so it must
+         stop looking committed first.  An empty descriptor does
+         that while keeping the sequence number on disk. */
+      if (free_map_cnt == 0)
+        {
+          struct journal_desc *desc = (struct journal_desc *) scratch;
+
+          memset (desc, 0, BLOCK_SECTOR_SIZE);
+          desc->magic = DESC_MAGIC;
+          desc->seq = seq;
+          block_write (fs_device, LOG_SECTOR, desc);
+        }
+      txn[i] = sector;
+      free_map_cnt++;
+      if (ofs != 0 || size != BLOCK_SECTOR_SIZE)
+        cache_read (sector, scratch);
+    }
+  else if (ofs != 0 || size != BLOCK_SECTOR_SIZE)
+    block_read (fs_device, slot_sector (i), scratch);
+  memcpy (scratch + ofs, buffer, size);
+  block_write (fs_device, slot_sector (i), scratch);
+}
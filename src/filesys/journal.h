@@ -0,0 +1,17 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stddef.h>
+#include "devices/block.h"
+
+void journal_create (void);
+void journal_open (void);
+void journal_done (void);
+
+void journal_begin (size_t sector_cnt);
+void journal_end (void);
+void journal_write (block_sector_t, const void *);
+void journal_write_at (block_sector_t, const void *, size_t ofs, size_t size);
+void journal_commit (void);
+
+#endif /* filesys/journal.h */
@@ -1,5 +1,26 @@
 #include <string.h>
 #include <debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The block and string functions below work a 32-bit word at a
+   time where they can.  A word is read through this type, which
+   may alias any other object. */
+typedef uint32_t word_t __attribute__ ((may_alias));
+
+/* Returns true if P is word-aligned. */
+static inline bool
+is_word_aligned (const void *p) 
+{
+  return ((uintptr_t) p & (sizeof (word_t) - 1)) == 0;
+}
+
+/* Returns nonzero if any byte in W is zero. */
+static inline word_t
+has_zero_byte (word_t w) 
+{
+  return (w - 0x01010101) & ~w & 0x80808080;
+}
 
 /* Copies SIZE bytes from SRC to DST, which must not overlap.
    Returns DST. */
@@ -9,11 +30,27 @@ memcpy (void *dst_, const void *src_, size_t size)
   unsigned char *dst = dst_;
   const unsigned char *src = src_;
 
+  size_t head;
+  int ecx, edi, esi;
+
   ASSERT (dst != NULL || size == 0);
   ASSERT (src != NULL || size == 0);
 
-  while (size-- > 0)
-    *dst++ = *src++;
+  /* Copy bytes until DST is word-aligned, then whole words, then
+     the bytes that are left over. */
+  head = -(uintptr_t) dst & (sizeof (word_t) - 1);
+  if (head > size)
+    head = size;
+  size -= head;
+  asm volatile ("rep movsb\n\t"
+                "movl %4, %%ecx\n\t"
+                "rep movsl\n\t"
+                "movl %5, %%ecx\n\t"
+                "rep movsb"
+                : "=&c" (ecx), "=&D" (edi), "=&S" (esi)
+                : "0" (head), "g" (size / sizeof (word_t)),
+                  "g" (size % sizeof (word_t)), "1" (dst), "2" (src)
+                : "memory");
 
   return dst_;
 }
@@ -58,6 +95,16 @@ memcmp (const void *a_, const void *b_, size_t size)
   ASSERT (a != NULL || size == 0);
   ASSERT (b != NULL || size == 0);
 
+  /* Skip over equal words, then find the differing byte. */
+  if (is_word_aligned (a) && is_word_aligned (b))
+    for (; size >= sizeof (word_t); size -= sizeof (word_t))
+      {
+        if (*(const word_t *) a != *(const word_t *) b)
+          break;
+        a += sizeof (word_t);
+        b += sizeof (word_t);
+      }
+
   for (; size-- > 0; a++, b++)
     if (*a != *b)
       return *a > *b ? +1 : -1;
@@ -113,9 +160,23 @@ char *
 strchr (const char *string, int c_) 
 {
   char c = c_;
+  word_t c_word = (unsigned char) c * 0x01010101u;
 
   ASSERT (string != NULL);
 
+  /* Go a byte at a time until STRING is word-aligned, then skip
+     whole words that contain neither C nor a null terminator.
+     An aligned word never crosses a page boundary, so reading
+     past the terminator cannot fault. */
+  for (; !is_word_aligned (string); string++)
+    if (*string == c)
+      return (char *) string;
+    else if (*string == '\0')
+      return NULL;
+  while (!has_zero_byte (*(const word_t *) string)
+         && !has_zero_byte (*(const word_t *) string ^ c_word))
+    string += sizeof (word_t);
+
   for (;;) 
     if (*string == c)
       return (char *) string;
@@ -279,11 +340,27 @@ void *
 memset (void *dst_, int value, size_t size) 
 {
   unsigned char *dst = dst_;
+  word_t fill = (unsigned char) value * 0x01010101u;
+  size_t head;
+  int ecx, edi;
 
   ASSERT (dst != NULL || size == 0);
-  
-  while (size-- > 0)
-    *dst++ = value;
+
+  /* Store bytes until DST is word-aligned, then whole words,
+     then the bytes that are left over. */
+  head = -(uintptr_t) dst & (sizeof (word_t) - 1);
+  if (head > size)
+    head = size;
+  size -= head;
+  asm volatile ("rep stosb\n\t"
+                "movl %3, %%ecx\n\t"
+                "rep stosl\n\t"
+                "movl %4, %%ecx\n\t"
+                "rep stosb"
+                : "=&c" (ecx), "=&D" (edi)
+                : "a" (fill), "g" (size / sizeof (word_t)),
+                  "g" (size % sizeof (word_t)), "0" (head), "1" (dst)
+                : "memory");
 
   return dst_;
 }
@@ -296,7 +373,17 @@ strlen (const char *string)
 
   ASSERT (string != NULL);
 
-  for (p = string; *p != '\0'; p++)
+  /* Go a byte at a time until P is word-aligned, then skip whole
+     words with no null terminator.  An aligned word never
+     crosses a page boundary, so reading past the terminator
+     cannot fault. */
+  for (p = string; !is_word_aligned (p); p++)
+    if (*p == '\0')
+      return p - string;
+  while (!has_zero_byte (*(const word_t *) p))
+    p += sizeof (word_t);
+
+  for (; *p != '\0'; p++)
     continue;
   return p - string;
 }
@@ -0,0 +1,74 @@
+#ifndef THREADS_FIXED_POINT_H
+#define THREADS_FIXED_POINT_H
+
+#include <stdint.h>
+
+/* Signed 17.14 fixed-point real numbers, used by the 4.4BSD
+   scheduler for load_avg and recent_cpu.
+
+   A fixed-point number X represents the real number X / FP_F.
+   The 17 integer bits allow magnitudes up to 131,071, which is
+   plenty for the scheduler's values.  Products and quotients of
+   two fixed-point numbers are formed in 64 bits so that the
+   intermediate result cannot overflow. */
+typedef int32_t fixed_point;
+
+#define FP_FRAC_BITS 14                 /* Number of fraction bits. */
+#define FP_F (1 << FP_FRAC_BITS)        /* Fixed-point 1. */
+
+/* Converts integer N to fixed point. */
+static inline fixed_point fp_from_int (int n) {
+  return n * FP_F;
+}
+
+/* Converts X to an integer, rounding toward zero. */
+static inline int fp_to_int (fixed_point x) {
+  return x / FP_F;
+}
+
+/* Converts X to an integer, rounding to nearest. */
+static inline int fp_round (fixed_point x) {
+  return x >= 0 ? (x + FP_F / 2) / FP_F : (x - FP_F / 2) / FP_F;
+}
+
+/* Returns X + Y. */
+static inline fixed_point fp_add (fixed_point x, fixed_point y) {
+  return x + y;
+}
+
+/* Returns X - Y. */
+static inline fixed_point fp_sub (fixed_point x, fixed_point y) {
+  return x - y;
+}
+
+/* Returns X + N, for integer N. */
+static inline fixed_point fp_add_int (fixed_point x, int n) {
+  return x + n * FP_F;
+}
+
+/* Returns X - N, for integer N. */
+static inline fixed_point fp_sub_int (fixed_point x, int n) {
+  return x - n * FP_F;
+}
+
+/* Returns X * Y. */
+static inline fixed_point fp_mul (fixed_point x, fixed_point y) {
+  return ((int64_t) x) * y / FP_F;
+}
+
+/* Returns X * N, for integer N. */
+static inline fixed_point fp_mul_int (fixed_point x, int n) {
+  return x * n;
+}
+
+/* Returns X / Y. */
+static inline fixed_point fp_div (fixed_point x, fixed_point y) {
+  return ((int64_t) x) * FP_F / y;
+}
+
+/* Returns X / N, for integer N. */
+static inline fixed_point fp_div_int (fixed_point x, int n) {
+  return x / n;
+}
+
+#endif /* threads/fixed-point.h */
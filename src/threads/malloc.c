@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/palloc.h"
+#include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
@@ -32,7 +33,19 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   Frequently allocated kernel objects can instead come from an
+   object cache created with kmem_cache_create().  A cache is a
+   descriptor whose block size is the object's exact size, so its
+   arenas ("slabs") waste no space to power-of-2 rounding.  Each
+   cache also keeps a small magazine of recently freed objects
+   that are handed out again without taking the descriptor's
+   lock.  There is only one CPU, so the magazine is per-CPU in
+   the usual sense and is protected by briefly disabling
+   interrupts.  If the cache has a constructor, objects in the
+   magazine stay constructed; the constructor runs only when an
+   object is taken from a slab. */
 
 /* Descriptor. */
 struct desc
@@ -64,6 +77,22 @@ struct block
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Number of objects a cache's magazine can hold. */
+#define MAGAZINE_SIZE 16
+
+/* Object cache. */
+struct kmem_cache
+  {
+    struct desc desc;           /* Slabs of exactly-sized blocks. */
+    const char *name;           /* Name, for debugging. */
+    void (*ctor) (void *);      /* Constructor, or null. */
+    void *magazine[MAGAZINE_SIZE];  /* Recently freed objects. */
+    size_t magazine_cnt;        /* Number of objects in MAGAZINE. */
+  };
+
+static void desc_init (struct desc *, size_t block_size);
+static void *desc_alloc (struct desc *);
+static void desc_free (struct desc *, struct block *);
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
 
@@ -77,20 +106,26 @@ malloc_init (void)
     {
       struct desc *d = &descs[desc_cnt++];
       ASSERT (desc_cnt <= sizeof descs / sizeof *descs);
-      d->block_size = block_size;
-      d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
-      list_init (&d->free_list);
-      lock_init (&d->lock);
+      desc_init (d, block_size);
     }
 }
 
+/* Initializes descriptor D for blocks of BLOCK_SIZE bytes. */
+static void
+desc_init (struct desc *d, size_t block_size) 
+{
+  d->block_size = block_size;
+  d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
+  list_init (&d->free_list);
+  lock_init (&d->lock);
+}
+
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) 
 {
   struct desc *d;
-  struct block *b;
   struct arena *a;
 
   /* A null pointer satisfies a request for 0 bytes. */
@@ -119,6 +154,18 @@ malloc (size_t size)
       return a + 1;
     }
 
+  return desc_alloc (d);
+}
+
+/* Obtains and returns a free block from descriptor D, creating a
+   new arena if necessary.  Returns a null pointer if memory is
+   not available. */
+static void *
+desc_alloc (struct desc *d) 
+{
+  struct block *b;
+  struct arena *a;
+
   lock_acquire (&d->lock);
 
   /* If the free list is empty, create a new arena. */
@@ -227,32 +274,11 @@ free (void *p)
       if (d != NULL) 
         {
           /* It's a normal block.  We handle it here. */
-
 #ifndef NDEBUG
           /* Clear the block to help detect use-after-free bugs. */
           memset (b, 0xcc, d->block_size);
 #endif
-  
-          lock_acquire (&d->lock);
-
-          /* Add block to free list. */
-          list_push_front (&d->free_list, &b->free_elem);
-
-          /* If the arena is now entirely unused, free it. */
-          if (++a->free_cnt >= d->blocks_per_arena) 
-            {
-              size_t i;
-
-              ASSERT (a->free_cnt == d->blocks_per_arena);
-              for (i = 0; i < d->blocks_per_arena; i++) 
-                {
-                  struct block *b = arena_to_block (a, i);
-                  list_remove (&b->free_elem);
-                }
-              palloc_free_page (a);
-            }
-
-          lock_release (&d->lock);
+          desc_free (d, b);
         }
       else
         {
@@ -262,6 +288,115 @@ free (void *p)
         }
     }
 }
+
+/* Returns block B to descriptor D's free list, giving its arena
+   back to the page allocator if the arena is now unused. */
+static void
+desc_free (struct desc *d, struct block *b) 
+{
+  struct arena *a = block_to_arena (b);
+
+  lock_acquire (&d->lock);
+
+  /* Add block to free list. */
+  list_push_front (&d->free_list, &b->free_elem);
+
+  /* If the arena is now entirely unused, free it. */
+  if (++a->free_cnt >= d->blocks_per_arena) 
+    {
+      size_t i;
+
+      ASSERT (a->free_cnt == d->blocks_per_arena);
+      for (i = 0; i < d->blocks_per_arena; i++) 
+        {
+          struct block *b = arena_to_block (a, i);
+          list_remove (&b->free_elem);
+        }
+      palloc_free_page (a);
+    }
+
+  lock_release (&d->lock);
+}
+
+/* Creates and returns a cache of SIZE-byte objects named NAME.
+   If CTOR is nonnull, it is called on each object when the
+   object is first taken from a slab, and objects freed with
+   kmem_cache_free() must be returned in their constructed
+   state.  Returns a null pointer if memory is not available. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, void (*ctor) (void *)) 
+{
+  struct kmem_cache *c;
+  size_t block_size;
+
+  /* Every block must hold a free list element while it is free
+     and must keep the blocks after it word-aligned. */
+  block_size = ROUND_UP (size < sizeof (struct block)
+                         ? sizeof (struct block) : size,
+                         sizeof (uint32_t));
+  ASSERT (block_size <= PGSIZE - sizeof (struct arena));
+
+  c = malloc (sizeof *c);
+  if (c == NULL)
+    return NULL;
+  desc_init (&c->desc, block_size);
+  c->name = name;
+  c->ctor = ctor;
+  c->magazine_cnt = 0;
+  return c;
+}
+
+/* Obtains and returns an object from cache C.  Returns a null
+   pointer if memory is not available. */
+void *
+kmem_cache_alloc (struct kmem_cache *c) 
+{
+  enum intr_level old_level;
+  void *p = NULL;
+
+  old_level = intr_disable ();
+  if (c->magazine_cnt > 0)
+    p = c->magazine[--c->magazine_cnt];
+  intr_set_level (old_level);
+  if (p != NULL)
+    return p;
+
+  p = desc_alloc (&c->desc);
+  if (p != NULL && c->ctor != NULL)
+    c->ctor (p);
+  return p;
+}
+
+/* Returns object P, which must have been obtained from
+   kmem_cache_alloc(C), to cache C. */
+void
+kmem_cache_free (struct kmem_cache *c, void *p) 
+{
+  enum intr_level old_level;
+  bool cached = false;
+
+  if (p == NULL)
+    return;
+  ASSERT (block_to_arena (p)->desc == &c->desc);
+
+#ifndef NDEBUG
+  /* Clear the object to help detect use-after-free bugs, unless
+     it must stay constructed. */
+  if (c->ctor == NULL)
+    memset (p, 0xcc, c->desc.block_size);
+#endif
+
+  old_level = intr_disable ();
+  if (c->magazine_cnt < MAGAZINE_SIZE) 
+    {
+      c->magazine[c->magazine_cnt++] = p;
+      cached = true;
+    }
+  intr_set_level (old_level);
+
+  if (!cached)
+    desc_free (&c->desc, p);
+}
 
 /* Returns the arena that block B is inside. */
 static struct arena *
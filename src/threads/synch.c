@@ -32,6 +32,12 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 
+/* Maximum length of a chain of lock holders that a priority
+   donation is propagated along. */
+#define DONATION_DEPTH_MAX 8
+
+static void donate_priority (struct lock *);
+
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
    manipulating it:
@@ -102,7 +108,11 @@ sema_try_down (struct semaphore *sema)
 }
 
 /* Up or "V" operation on a semaphore.  Increments SEMA's value
-   and wakes up one thread of those waiting for SEMA, if any.
+   and wakes up the highest-priority thread of those waiting for
+   SEMA, if any, yielding to it if it outranks the running
+   thread.  Priorities may have changed through donation while
+   the threads waited, so the waiters are searched rather than
+   kept sorted.
 
    This function may be called from an interrupt handler. */
 void
@@ -114,10 +124,17 @@ sema_up (struct semaphore *sema)
 
   old_level = intr_disable ();
   if (!list_empty (&sema->waiters)) 
-    thread_unblock (list_entry (list_pop_front (&sema->waiters),
-                                struct thread, elem));
+    {
+      struct list_elem *e = list_max (&sema->waiters, thread_priority_less,
+                                      NULL);
+      list_remove (e);
+      thread_unblock (list_entry (e, struct thread, elem));
+    }
   sema->value++;
   intr_set_level (old_level);
+
+  if (!intr_context ())
+    thread_preempt ();
 }
 
 static void sema_test_helper (void *sema_);
@@ -181,10 +198,39 @@ lock_init (struct lock *lock)
   sema_init (&lock->semaphore, 1);
 }
 
+/* Donates the running thread's priority, which is about to wait
+   for LOCK, to LOCK's holder.  If the holder is itself waiting
+   for a lock, the donation is passed along the chain of holders,
+   up to DONATION_DEPTH_MAX threads deep.  Must be called with
+   interrupts off. */
+static void
+donate_priority (struct lock *lock)
+{
+  int priority = thread_current ()->priority;
+  int depth;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  for (depth = 0; depth < DONATION_DEPTH_MAX; depth++)
+    {
+      struct thread *holder = lock->holder;
+      if (holder == NULL || holder->priority >= priority)
+        break;
+      thread_donate_priority (holder, priority);
+      lock = holder->waiting_lock;
+      if (lock == NULL)
+        break;
+    }
+}
+
 /* Acquires LOCK, sleeping until it becomes available if
    necessary.  The lock must not already be held by the current
    thread.
 
+   While waiting, the current thread donates its priority to the
+   lock's holder (unless the MLFQS scheduler is in use), so that
+   a low-priority holder cannot indefinitely delay it.
+
    This function may sleep, so it must not be called within an
    interrupt handler.  This function may be called with
    interrupts disabled, but interrupts will be turned back on if
@@ -192,12 +238,24 @@ lock_init (struct lock *lock)
 void
 lock_acquire (struct lock *lock)
 {
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
   ASSERT (lock != NULL);
   ASSERT (!intr_context ());
   ASSERT (!lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
+  if (lock->holder != NULL && !thread_mlfqs)
+    {
+      cur->waiting_lock = lock;
+      donate_priority (lock);
+    }
   sema_down (&lock->semaphore);
-  lock->holder = thread_current ();
+  cur->waiting_lock = NULL;
+  lock->holder = cur;
+  list_push_back (&cur->held_locks, &lock->elem);
+  intr_set_level (old_level);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -209,30 +267,46 @@ lock_acquire (struct lock *lock)
 bool
 lock_try_acquire (struct lock *lock)
 {
+  enum intr_level old_level;
   bool success;
 
   ASSERT (lock != NULL);
   ASSERT (!lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
   success = sema_try_down (&lock->semaphore);
   if (success)
-    lock->holder = thread_current ();
+    {
+      lock->holder = thread_current ();
+      list_push_back (&thread_current ()->held_locks, &lock->elem);
+    }
+  intr_set_level (old_level);
   return success;
 }
 
 /* Releases LOCK, which must be owned by the current thread.
 
+   Any priority that waiters for LOCK donated to the current
+   thread is withdrawn, which may cause it to yield.
+
    An interrupt handler cannot acquire a lock, so it does not
    make sense to try to release a lock within an interrupt
    handler. */
 void
 lock_release (struct lock *lock) 
 {
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
   ASSERT (lock != NULL);
   ASSERT (lock_held_by_current_thread (lock));
 
+  old_level = intr_disable ();
+  list_remove (&lock->elem);
   lock->holder = NULL;
+  thread_refresh_priority (cur);
   sema_up (&lock->semaphore);
+  intr_set_level (old_level);
 }
 
 /* Returns true if the current thread holds LOCK, false
@@ -251,8 +325,21 @@ struct semaphore_elem
   {
     struct list_elem elem;              /* List element. */
     struct semaphore semaphore;         /* This semaphore. */
+    struct thread *thread;              /* Thread waiting on it. */
   };
 
+/* Compares the priorities of the threads waiting on the
+   semaphore_elems that contain A and B. */
+static bool
+waiter_priority_less (const struct list_elem *a_, const struct list_elem *b_,
+                      void *aux UNUSED)
+{
+  const struct semaphore_elem *a = list_entry (a_, struct semaphore_elem, elem);
+  const struct semaphore_elem *b = list_entry (b_, struct semaphore_elem, elem);
+
+  return a->thread->priority < b->thread->priority;
+}
+
 /* Initializes condition variable COND.  A condition variable
    allows one piece of code to signal a condition and cooperating
    code to receive the signal and act upon it. */
@@ -295,6 +382,7 @@ cond_wait (struct condition *cond, struct lock *lock)
   ASSERT (lock_held_by_current_thread (lock));
   
   sema_init (&waiter.semaphore, 0);
+  waiter.thread = thread_current ();
   list_push_back (&cond->waiters, &waiter.elem);
   lock_release (lock);
   sema_down (&waiter.semaphore);
@@ -302,7 +390,8 @@ cond_wait (struct condition *cond, struct lock *lock)
 }
 
 /* If any threads are waiting on COND (protected by LOCK), then
-   this function signals one of them to wake up from its wait.
+   this function signals the highest-priority one of them to wake
+   up from its wait.
    LOCK must be held before calling this function.
 
    An interrupt handler cannot acquire a lock, so it does not
@@ -317,8 +406,12 @@ cond_signal (struct condition *cond, struct lock *lock UNUSED)
   ASSERT (lock_held_by_current_thread (lock));
 
   if (!list_empty (&cond->waiters)) 
-    sema_up (&list_entry (list_pop_front (&cond->waiters),
-                          struct semaphore_elem, elem)->semaphore);
+    {
+      struct list_elem *e = list_max (&cond->waiters, waiter_priority_less,
+                                      NULL);
+      list_remove (e);
+      sema_up (&list_entry (e, struct semaphore_elem, elem)->semaphore);
+    }
 }
 
 /* Wakes up all threads, if any, waiting on COND (protected by
@@ -336,3 +429,163 @@ cond_broadcast (struct condition *cond, struct lock *lock)
   while (!list_empty (&cond->waiters))
     cond_signal (cond, lock);
 }
+
+/* Initializes RW as a readers-writer lock that follows POLICY.
+
+   Any number of threads may hold a readers-writer lock for
+   reading at once, but a thread holding it for writing excludes
+   all others.  POLICY decides what happens when both readers and
+   writers are waiting:
+
+   - RWLOCK_PREFER_READERS: a reader enters whenever no writer
+     holds the lock.  Readers get the most concurrency, but a
+     steady stream of them can starve writers.
+
+   - RWLOCK_PREFER_WRITERS: a reader also waits while any writer
+     is waiting, so writers are never starved, but readers can
+     be.
+
+   - RWLOCK_FAIR: like RWLOCK_PREFER_WRITERS, except that when a
+     writer releases the lock, every reader that was waiting at
+     that moment is let in before the next writer, so neither
+     side can be starved.  Each waiting reader remembers the
+     value of the lock's write generation when it began to wait,
+     so readers arriving after the release cannot take the place
+     of those it admitted. */
+void
+rwlock_init (struct rwlock *rw, enum rwlock_policy policy) 
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->can_read);
+  cond_init (&rw->can_write);
+  rw->policy = policy;
+  rw->writer = NULL;
+  rw->readers = 0;
+  rw->write_gen = 0;
+  rw->waiting_readers = 0;
+  rw->waiting_writers = 0;
+  rw->admitted_readers = 0;
+}
+
+/* Returns true if a thread asking to read RW, which began to
+   wait when RW's write generation was GEN, must wait.  RW's lock
+   must be held. */
+static bool
+reader_must_wait (const struct rwlock *rw, unsigned gen) 
+{
+  if (rw->writer != NULL)
+    return true;
+  switch (rw->policy) 
+    {
+    case RWLOCK_PREFER_READERS:
+      return false;
+    case RWLOCK_PREFER_WRITERS:
+      return rw->waiting_writers > 0;
+    case RWLOCK_FAIR:
+      return rw->waiting_writers > 0 && gen == rw->write_gen;
+    default:
+      NOT_REACHED ();
+    }
+}
+
+/* Acquires RW for reading, sleeping until no writer holds it
+   and RW's policy lets this thread in.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_read (struct rwlock *rw) 
+{
+  unsigned gen;
+
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rw->writer != thread_current ());
+
+  lock_acquire (&rw->lock);
+  gen = rw->write_gen;
+  if (reader_must_wait (rw, gen)) 
+    {
+      rw->waiting_readers++;
+      do
+        cond_wait (&rw->can_read, &rw->lock);
+      while (reader_must_wait (rw, gen));
+
+      /* If RW was released for writing since GEN, that release
+         counted this reader among those it admitted. */
+      if (gen == rw->write_gen)
+        rw->waiting_readers--;
+      else
+        rw->admitted_readers--;
+    }
+  rw->readers++;
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for reading. */
+void
+rwlock_release_read (struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->readers > 0);
+  if (--rw->readers == 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no other thread holds
+   it and no readers admitted ahead of this thread are still to
+   come in.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rwlock_acquire_write (struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rw->writer != thread_current ());
+
+  lock_acquire (&rw->lock);
+  rw->waiting_writers++;
+  while (rw->writer != NULL || rw->readers > 0
+         || (rw->policy == RWLOCK_FAIR && rw->admitted_readers > 0))
+    cond_wait (&rw->can_write, &rw->lock);
+  rw->waiting_writers--;
+  rw->writer = thread_current ();
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for writing. */
+void
+rwlock_release_write (struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+  ASSERT (rwlock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  rw->writer = NULL;
+  rw->write_gen++;
+  rw->admitted_readers += rw->waiting_readers;
+  rw->waiting_readers = 0;
+  if (rw->admitted_readers > 0
+      && (rw->policy != RWLOCK_PREFER_WRITERS || rw->waiting_writers == 0))
+    cond_broadcast (&rw->can_read, &rw->lock);
+  else
+    cond_signal (&rw->can_write, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW for writing, false
+   otherwise. */
+bool
+rwlock_held_for_write (const struct rwlock *rw) 
+{
+  ASSERT (rw != NULL);
+
+  return rw->writer == thread_current ();
+}
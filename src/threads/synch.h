@@ -20,8 +20,9 @@ void sema_self_test (void);
 /* Lock. */
 struct lock 
   {
-    struct thread *holder;      /* Thread holding lock (for debugging). */
+    struct thread *holder;      /* Thread holding lock. */
     struct semaphore semaphore; /* Binary semaphore controlling access. */
+    struct list_elem elem;      /* Element in holder's held_locks list. */
   };
 
 void lock_init (struct lock *);
@@ -41,6 +42,36 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Which threads a readers-writer lock lets in first. */
+enum rwlock_policy
+  {
+    RWLOCK_PREFER_READERS,      /* Readers never wait for waiting writers. */
+    RWLOCK_PREFER_WRITERS,      /* Waiting writers hold off new readers. */
+    RWLOCK_FAIR                 /* Readers and writers take turns. */
+  };
+
+/* Readers-writer lock. */
+struct rwlock 
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition can_read;  /* Signaled when readers may enter. */
+    struct condition can_write; /* Signaled when a writer may enter. */
+    enum rwlock_policy policy;  /* Who goes first. */
+    struct thread *writer;      /* Thread holding it for writing. */
+    unsigned readers;           /* Number of threads reading. */
+    unsigned write_gen;         /* Number of releases for writing. */
+    unsigned waiting_readers;   /* Readers waiting since last of those. */
+    unsigned waiting_writers;   /* Number of threads waiting to write. */
+    unsigned admitted_readers;  /* Waiting readers let in ahead of writers. */
+  };
+
+void rwlock_init (struct rwlock *, enum rwlock_policy);
+void rwlock_acquire_read (struct rwlock *);
+void rwlock_release_read (struct rwlock *);
+void rwlock_acquire_write (struct rwlock *);
+void rwlock_release_write (struct rwlock *);
+bool rwlock_held_for_write (const struct rwlock *);
+
 /* Optimization barrier.
 
    The compiler will not reorder operations across an
@@ -11,18 +11,28 @@
 #include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
+#ifdef FILESYS
+#include "filesys/directory.h"
+#endif
 
 /* Random value for struct thread's `magic' member.
    Used to detect stack overflow.  See the big comment at the top
    of thread.h for details. */
 #define THREAD_MAGIC 0xcd6abf4b
 
-/* List of processes in THREAD_READY state, that is, processes
-   that are ready to run but not actually running. */
-static struct list ready_list;
+/* Run queue of processes in THREAD_READY state, that is,
+   processes that are ready to run but not actually running.
+   There is one FIFO list per priority level, and bit P of
+   ready_mask is set if and only if ready_lists[P] is nonempty, so
+   that both enqueueing a thread and finding the highest-priority
+   ready thread take constant time. */
+static struct list ready_lists[PRI_MAX + 1];
+static uint64_t ready_mask;
+static int ready_cnt;           /* Number of threads in the run queue. */
 
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
@@ -59,6 +69,23 @@ static unsigned thread_ticks;   /* # of timer ticks since last yield. */
    Controlled by kernel command-line option "-o mlfqs". */
 bool thread_mlfqs;
 
+/* MLFQS scheduler state.
+
+   Once a second, every thread's recent_cpu decays by a factor
+   that depends on the load average at that moment.  Only the
+   threads that are running or ready are decayed right away,
+   because only their priorities matter for scheduling.  A blocked
+   thread instead remembers in recent_cpu_epoch how many decays it
+   has received, and catches up on the rest in thread_unblock(),
+   using the factors saved in decay_history.  Whenever
+   decay_history is about to wrap around, all blocked threads
+   are brought up to date, which happens once every
+   DECAY_HISTORY_CNT seconds instead of every second. */
+static fixed_point load_avg;            /* System load average. */
+static int64_t decay_epoch;             /* Number of decays so far. */
+#define DECAY_HISTORY_CNT 64
+static fixed_point decay_history[DECAY_HISTORY_CNT]; /* Recent factors. */
+
 static void kernel_thread (thread_func *, void *aux);
 
 static void idle (void *aux UNUSED);
@@ -67,6 +94,15 @@ static struct thread *next_thread_to_run (void);
 static void init_thread (struct thread *, const char *name, int priority);
 static bool is_thread (struct thread *) UNUSED;
 static void *alloc_frame (struct thread *, size_t size);
+static void ready_push (struct thread *);
+static void ready_remove (struct thread *);
+static void set_effective_priority (struct thread *, int priority);
+static void mlfqs_tick (void);
+static void mlfqs_decay (void);
+static void mlfqs_catch_up (struct thread *, void *aux);
+static int mlfqs_priority (struct thread *);
+static struct thread *ready_pop (void);
+static int ready_max_priority (void);
 static void schedule (void);
 void thread_schedule_tail (struct thread *prev);
 static tid_t allocate_tid (void);
@@ -87,10 +123,15 @@ static tid_t allocate_tid (void);
 void
 thread_init (void) 
 {
+  int i;
+
   ASSERT (intr_get_level () == INTR_OFF);
 
   lock_init (&tid_lock);
-  list_init (&ready_list);
+  for (i = PRI_MIN; i <= PRI_MAX; i++)
+    list_init (&ready_lists[i]);
+  ready_mask = 0;
+  ready_cnt = 0;
   list_init (&all_list);
 
   /* Set up a thread structure for the running thread. */
@@ -134,6 +175,9 @@ thread_tick (void)
   else
     kernel_ticks++;
 
+  if (thread_mlfqs)
+    mlfqs_tick ();
+
   /* Enforce preemption. */
   if (++thread_ticks >= TIME_SLICE)
     intr_yield_on_return ();
@@ -159,9 +203,8 @@ thread_print_stats (void)
    scheduled.  Use a semaphore or some other form of
    synchronization if you need to ensure ordering.
 
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   If the new thread has a higher priority than the running
+   thread, the running thread yields to it immediately. */
 tid_t
 thread_create (const char *name, int priority,
                thread_func *function, void *aux) 
@@ -182,6 +225,11 @@ thread_create (const char *name, int priority,
   /* Initialize thread. */
   init_thread (t, name, priority);
   tid = t->tid = allocate_tid ();
+#ifdef FILESYS
+  /* A new thread starts in its creator's working directory. */
+  if (thread_current ()->cwd != NULL)
+    t->cwd = dir_reopen (thread_current ()->cwd);
+#endif
 
   /* Stack frame for kernel_thread(). */
   kf = alloc_frame (t, sizeof *kf);
@@ -200,6 +248,7 @@ thread_create (const char *name, int priority,
 
   /* Add to run queue. */
   thread_unblock (t);
+  thread_preempt ();
 
   return tid;
 }
@@ -227,7 +276,10 @@ thread_block (void)
    This function does not preempt the running thread.  This can
    be important: if the caller had disabled interrupts itself,
    it may expect that it can atomically unblock a thread and
-   update other data. */
+   update other data.
+
+   Under the MLFQS scheduler, T's recent_cpu and priority are
+   brought up to date before it is queued. */
 void
 thread_unblock (struct thread *t) 
 {
@@ -237,7 +289,12 @@ thread_unblock (struct thread *t)
 
   old_level = intr_disable ();
   ASSERT (t->status == THREAD_BLOCKED);
-  list_push_back (&ready_list, &t->elem);
+  if (thread_mlfqs)
+    {
+      mlfqs_catch_up (t, NULL);
+      t->priority = mlfqs_priority (t);
+    }
+  ready_push (t);
   t->status = THREAD_READY;
   intr_set_level (old_level);
 }
@@ -285,6 +342,10 @@ thread_exit (void)
 #ifdef USERPROG
   process_exit ();
 #endif
+#ifdef FILESYS
+  dir_close (thread_current ()->cwd);
+  thread_current ()->cwd = NULL;
+#endif
 
   /* Remove thread from all threads list, set our status to dying,
      and schedule another process.  That process will destroy us
@@ -310,7 +371,7 @@ thread_yield (void)
 
   old_level = intr_disable ();
   if (cur != idle_thread) 
-    list_push_back (&ready_list, &cur->elem);
+    ready_push (cur);
   cur->status = THREAD_READY;
   schedule ();
   intr_set_level (old_level);
@@ -333,60 +394,285 @@ thread_foreach (thread_action_func *func, void *aux)
     }
 }
 
-/* Sets the current thread's priority to NEW_PRIORITY. */
+/* Yields the CPU if some ready thread has a higher priority
+   than the running thread.  Within an interrupt handler, the
+   yield is deferred until the handler returns. */
+void
+thread_preempt (void)
+{
+  enum intr_level old_level = intr_disable ();
+
+  if (ready_mask != 0
+      && ready_max_priority () > thread_current ()->priority)
+    {
+      if (intr_context ())
+        intr_yield_on_return ();
+      else
+        thread_yield ();
+    }
+  intr_set_level (old_level);
+}
+
+/* Sets the current thread's base priority to NEW_PRIORITY.  The
+   effective priority stays raised while other threads donate a
+   higher one.  Yields if the running thread no longer has the
+   highest priority.  Does nothing under the MLFQS scheduler,
+   which computes priorities itself. */
 void
 thread_set_priority (int new_priority) 
 {
-  thread_current ()->priority = new_priority;
+  enum intr_level old_level;
+
+  ASSERT (PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+
+  if (thread_mlfqs)
+    return;
+
+  old_level = intr_disable ();
+  thread_current ()->base_priority = new_priority;
+  thread_refresh_priority (thread_current ());
+  intr_set_level (old_level);
+  thread_preempt ();
 }
 
-/* Returns the current thread's priority. */
+/* Returns the current thread's effective priority. */
 int
 thread_get_priority (void) 
 {
   return thread_current ()->priority;
 }
 
-/* Sets the current thread's nice value to NICE. */
+/* Recomputes T's effective priority as the maximum of its base
+   priority and the priorities of all the threads waiting on
+   locks that T holds.  Must be called with interrupts off.  Does
+   nothing under the MLFQS scheduler, which does not donate. */
 void
-thread_set_nice (int nice UNUSED) 
+thread_refresh_priority (struct thread *t)
 {
-  /* Not yet implemented. */
+  int priority = t->base_priority;
+  struct list_elem *e;
+
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (thread_mlfqs)
+    return;
+
+  for (e = list_begin (&t->held_locks); e != list_end (&t->held_locks);
+       e = list_next (e))
+    {
+      struct lock *lock = list_entry (e, struct lock, elem);
+      struct list *waiters = &lock->semaphore.waiters;
+
+      if (!list_empty (waiters))
+        {
+          struct thread *w = list_entry (list_max (waiters,
+                                                   thread_priority_less,
+                                                   NULL),
+                                         struct thread, elem);
+          if (w->priority > priority)
+            priority = w->priority;
+        }
+    }
+  set_effective_priority (t, priority);
+}
+
+/* Raises T's effective priority to PRIORITY, if it is lower, on
+   behalf of a thread waiting for a lock that T holds.  Must be
+   called with interrupts off. */
+void
+thread_donate_priority (struct thread *t, int priority)
+{
+  ASSERT (is_thread (t));
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (t->priority < priority)
+    set_effective_priority (t, priority);
+}
+
+/* Compares the effective priorities of the threads that contain
+   list elements A and B, which must be `elem' members. */
+bool
+thread_priority_less (const struct list_elem *a_, const struct list_elem *b_,
+                      void *aux UNUSED)
+{
+  const struct thread *a = list_entry (a_, struct thread, elem);
+  const struct thread *b = list_entry (b_, struct thread, elem);
+
+  return a->priority < b->priority;
+}
+
+/* Sets the current thread's nice value to NICE and recomputes
+   its priority, yielding if it no longer has the highest
+   priority. */
+void
+thread_set_nice (int nice) 
+{
+  struct thread *cur = thread_current ();
+  enum intr_level old_level;
+
+  ASSERT (NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable ();
+  cur->nice = nice;
+  if (thread_mlfqs)
+    set_effective_priority (cur, mlfqs_priority (cur));
+  intr_set_level (old_level);
+  thread_preempt ();
 }
 
 /* Returns the current thread's nice value. */
 int
 thread_get_nice (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  return thread_current ()->nice;
 }
 
 /* Returns 100 times the system load average. */
 int
 thread_get_load_avg (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int load_avg_100 = fp_round (fp_mul_int (load_avg, 100));
+  intr_set_level (old_level);
+
+  return load_avg_100;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int
 thread_get_recent_cpu (void) 
 {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable ();
+  int recent_cpu_100 = fp_round (fp_mul_int (thread_current ()->recent_cpu,
+                                             100));
+  intr_set_level (old_level);
+
+  return recent_cpu_100;
 }
-
+
+/* Updates MLFQS statistics for a timer tick.  The running thread
+   is charged for the tick, and its priority, the only one that
+   the charge can affect, is recomputed every fourth tick.  Once a
+   second, the load average is updated and recent_cpu is
+   decayed. */
+static void
+mlfqs_tick (void)
+{
+  struct thread *cur = thread_current ();
+  int64_t ticks = timer_ticks ();
+
+  if (cur != idle_thread)
+    cur->recent_cpu = fp_add_int (cur->recent_cpu, 1);
+
+  if (ticks % TIMER_FREQ == 0)
+    mlfqs_decay ();
+  else if (ticks % 4 == 0 && cur != idle_thread)
+    set_effective_priority (cur, mlfqs_priority (cur));
+}
+
+/* Updates the load average, then decays recent_cpu and
+   recomputes the priority of the running thread and each ready
+   thread.  Blocked threads are handled lazily by
+   mlfqs_catch_up(). */
+static void
+mlfqs_decay (void)
+{
+  struct thread *cur = thread_current ();
+  int ready_threads = ready_cnt + (cur != idle_thread ? 1 : 0);
+  fixed_point twice_load;
+  struct list ready;
+  int priority;
+
+  ASSERT (intr_context ());
+
+  /* load_avg = (59/60)*load_avg + (1/60)*ready_threads. */
+  load_avg = fp_add (fp_div_int (fp_mul_int (load_avg, 59), 60),
+                     fp_div_int (fp_from_int (ready_threads), 60));
+
+  /* Make sure no blocked thread still needs the factor that is
+     about to be overwritten. */
+  if (decay_epoch % DECAY_HISTORY_CNT == 0)
+    thread_foreach (mlfqs_catch_up, NULL);
+
+  /* Record this second's factor, (2*load_avg)/(2*load_avg + 1). */
+  twice_load = fp_mul_int (load_avg, 2);
+  decay_history[decay_epoch % DECAY_HISTORY_CNT]
+    = fp_div (twice_load, fp_add_int (twice_load, 1));
+  decay_epoch++;
+
+  if (cur != idle_thread)
+    {
+      mlfqs_catch_up (cur, NULL);
+      cur->priority = mlfqs_priority (cur);
+    }
+
+  /* Empty the run queue into READY, then requeue each thread at
+     its new priority. */
+  list_init (&ready);
+  for (priority = PRI_MAX; priority >= PRI_MIN; priority--)
+    {
+      struct list *list = &ready_lists[priority];
+      if (!list_empty (list))
+        list_splice (list_end (&ready), list_begin (list), list_end (list));
+    }
+  ready_mask = 0;
+  ready_cnt = 0;
+  while (!list_empty (&ready))
+    {
+      struct thread *t = list_entry (list_pop_front (&ready),
+                                     struct thread, elem);
+      mlfqs_catch_up (t, NULL);
+      t->priority = mlfqs_priority (t);
+      ready_push (t);
+    }
+}
+
+/* Applies to T's recent_cpu the per-second decays that it has
+   missed while blocked:
+   recent_cpu = (2*load_avg)/(2*load_avg + 1) * recent_cpu + nice.
+   Has the signature of thread_action_func so that it can be
+   passed to thread_foreach(). */
+static void
+mlfqs_catch_up (struct thread *t, void *aux UNUSED)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (decay_epoch - t->recent_cpu_epoch <= DECAY_HISTORY_CNT);
+
+  for (; t->recent_cpu_epoch < decay_epoch; t->recent_cpu_epoch++)
+    {
+      fixed_point coeff
+        = decay_history[t->recent_cpu_epoch % DECAY_HISTORY_CNT];
+      t->recent_cpu = fp_add_int (fp_mul (coeff, t->recent_cpu), t->nice);
+    }
+}
+
+/* Returns T's MLFQS priority,
+   PRI_MAX - (recent_cpu / 4) - (nice * 2),
+   truncated and clamped to the valid priority range. */
+static int
+mlfqs_priority (struct thread *t)
+{
+  fixed_point x = fp_sub (fp_from_int (PRI_MAX),
+                          fp_div_int (t->recent_cpu, 4));
+  int priority = fp_to_int (fp_sub_int (x, t->nice * 2));
+
+  if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  else if (priority > PRI_MAX)
+    priority = PRI_MAX;
+  return priority;
+}
+
 /* Idle thread.  Executes when no other thread is ready to run.
 
-   The idle thread is initially put on the ready list by
+   The idle thread is initially put on the run queue by
    thread_start().  It will be scheduled once initially, at which
    point it initializes idle_thread, "up"s the semaphore passed
    to it to enable thread_start() to continue, and immediately
    blocks.  After that, the idle thread never appears in the
-   ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   run queue.  It is returned by next_thread_to_run() as a
+   special case when the run queue is empty. */
 static void
 idle (void *idle_started_ UNUSED) 
 {
@@ -449,26 +735,43 @@ is_thread (struct thread *t)
 }
 
 /* Does basic initialization of T as a blocked thread named
-   NAME. */
+   NAME.  Under the MLFQS scheduler, T inherits the running
+   thread's nice and recent_cpu values and PRIORITY is ignored. */
 static void
 init_thread (struct thread *t, const char *name, int priority)
 {
+  struct thread *parent = running_thread ();
   enum intr_level old_level;
 
   ASSERT (t != NULL);
   ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
   ASSERT (name != NULL);
 
+  old_level = intr_disable ();
   memset (t, 0, sizeof *t);
   t->status = THREAD_BLOCKED;
   strlcpy (t->name, name, sizeof t->name);
   t->stack = (uint8_t *) t + PGSIZE;
-  t->priority = priority;
+  if (t != parent && is_thread (parent))
+    {
+      t->nice = parent->nice;
+      t->recent_cpu = parent->recent_cpu;
+    }
+  else
+    {
+      t->nice = NICE_DEFAULT;
+      t->recent_cpu = 0;
+    }
+  t->recent_cpu_epoch = decay_epoch;
+  if (thread_mlfqs)
+    priority = mlfqs_priority (t);
+  t->priority = t->base_priority = priority;
+  t->waiting_lock = NULL;
+  list_init (&t->held_locks);
   t->magic = THREAD_MAGIC;
   sema_init(&(t->thread_sem), 0);
   sema_init(&(t->failed_load), 0);
 
-  old_level = intr_disable ();
   list_push_back (&all_list, &t->allelem);
   intr_set_level (old_level);
 }
@@ -486,6 +789,82 @@ alloc_frame (struct thread *t, size_t size)
   return t->stack;
 }
 
+/* Adds T to the back of the run queue for its priority. */
+static void
+ready_push (struct thread *t)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (PRI_MIN <= t->priority && t->priority <= PRI_MAX);
+
+  list_push_back (&ready_lists[t->priority], &t->elem);
+  ready_mask |= (uint64_t) 1 << t->priority;
+  ready_cnt++;
+}
+
+/* Removes ready thread T from the run queue. */
+static void
+ready_remove (struct thread *t)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (t->status == THREAD_READY);
+
+  list_remove (&t->elem);
+  if (list_empty (&ready_lists[t->priority]))
+    ready_mask &= ~((uint64_t) 1 << t->priority);
+  ready_cnt--;
+}
+
+/* Changes T's effective priority to PRIORITY, moving T to the
+   matching run queue list if it is ready to run. */
+static void
+set_effective_priority (struct thread *t, int priority)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (PRI_MIN <= priority && priority <= PRI_MAX);
+
+  if (t->priority == priority)
+    return;
+  if (t->status == THREAD_READY)
+    {
+      ready_remove (t);
+      t->priority = priority;
+      ready_push (t);
+    }
+  else
+    t->priority = priority;
+}
+
+/* Returns the highest priority that has a thread in the run
+   queue.  The run queue must not be empty. */
+static int
+ready_max_priority (void)
+{
+  uint32_t high = ready_mask >> 32;
+  uint32_t low = ready_mask;
+
+  ASSERT (ready_mask != 0);
+  if (high != 0)
+    return 63 - __builtin_clz (high);
+  else
+    return 31 - __builtin_clz (low);
+}
+
+/* Removes and returns the thread at the front of the
+   highest-priority nonempty list in the run queue.  The run
+   queue must not be empty. */
+static struct thread *
+ready_pop (void)
+{
+  int priority = ready_max_priority ();
+  struct list *list = &ready_lists[priority];
+  struct thread *t = list_entry (list_pop_front (list), struct thread, elem);
+
+  if (list_empty (list))
+    ready_mask &= ~((uint64_t) 1 << priority);
+  ready_cnt--;
+  return t;
+}
+
 /* Chooses and returns the next thread to be scheduled.  Should
    return a thread from the run queue, unless the run queue is
    empty.  (If the running thread can continue running, then it
@@ -494,10 +873,10 @@ alloc_frame (struct thread *t, size_t size)
 static struct thread *
 next_thread_to_run (void) 
 {
-  if (list_empty (&ready_list))
+  if (ready_mask == 0)
     return idle_thread;
   else
-    return list_entry (list_pop_front (&ready_list), struct thread, elem);
+    return ready_pop ();
 }
 
 /* Completes a thread switch by activating the new thread's page
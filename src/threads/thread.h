@@ -2,8 +2,10 @@
 #define THREADS_THREAD_H
 
 #include <debug.h>
+#include <hash.h>
 #include <list.h>
 #include <stdint.h>
+#include "threads/fixed-point.h"
 #include "threads/synch.h"
 
 /* States in a thread's life cycle. */
@@ -25,6 +27,11 @@ typedef int tid_t;
 #define PRI_DEFAULT 31                  /* Default priority. */
 #define PRI_MAX 63                      /* Highest priority. */
 
+/* Thread nice values, for the MLFQS scheduler. */
+#define NICE_MIN -20                    /* Nicest to other threads. */
+#define NICE_DEFAULT 0                  /* Default nice value. */
+#define NICE_MAX 20                     /* Least nice to other threads. */
+
 /* A kernel thread or user process.
 
    Each thread structure is stored in its own 4 kB page.  The
@@ -75,12 +82,14 @@ typedef int tid_t;
    the `magic' member of the running thread's `struct thread' is
    set to THREAD_MAGIC.  Stack overflow will normally change this
    value, triggering the assertion. */
-/* The `elem' member has a dual purpose.  It can be an element in
-   the run queue (thread.c), or it can be an element in a
-   semaphore wait list (synch.c).  It can be used these two ways
-   only because they are mutually exclusive: only a thread in the
-   ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+/* The `elem' member has a triple purpose.  It can be an element
+   in the run queue (thread.c), an element in a semaphore wait
+   list (synch.c), or an element in the timer's sleep list
+   (devices/timer.c).  It can be used these ways only because
+   they are mutually exclusive: only a thread in the ready state
+   is on the run queue, whereas only a thread in the blocked
+   state is on a semaphore wait list or the sleep list, and a
+   sleeping thread is not waiting on a semaphore. */
 struct thread
   {
     /* Owned by thread.c. */
@@ -88,11 +97,19 @@ struct thread
     enum thread_status status;          /* Thread state. */
     char name[16];                      /* Name (for debugging purposes). */
     uint8_t *stack;                     /* Saved stack pointer. */
-    int priority;                       /* Priority. */
+    int priority;                       /* Effective priority. */
+    int base_priority;                  /* Priority before donation. */
     struct list_elem allelem;           /* List element for all threads list. */
-    int sleepTime;
+    int64_t wakeup_tick;                /* Tick to wake at in timer_sleep(). */
     /* Shared between thread.c and synch.c. */
     struct list_elem elem;              /* List element. */
+    struct lock *waiting_lock;          /* Lock being waited for, if any. */
+    struct list held_locks;             /* Locks held, for donation. */
+
+    /* MLFQS scheduler state, owned by thread.c. */
+    int nice;                           /* Nice value. */
+    fixed_point recent_cpu;             /* Recent CPU time, in ticks. */
+    int64_t recent_cpu_epoch;           /* Decays applied to recent_cpu. */
     struct semaphore thread_sem;
     struct thread* parent;
     struct semaphore failed_load;
@@ -101,6 +118,35 @@ struct thread
 #ifdef USERPROG
     /* Owned by userprog/process.c. */
     uint32_t *pagedir;                  /* Page directory. */
+
+    /* Owned by userprog/syscall.c. */
+    struct file_descriptor **fd_table;  /* Open files, indexed by fd. */
+    int fd_table_size;                  /* Number of slots in fd_table. */
+    int fd_lowest_free;                 /* No free slot below this fd. */
+#endif
+
+#ifdef FILESYS
+    /* Owned by filesys/filesys.c. */
+    struct dir *cwd;                    /* Working directory, null for root. */
+
+    /* Owned by filesys/journal.c. */
+    int journal_depth;                  /* Nesting depth of open handles. */
+    size_t journal_credits;             /* Sectors handle may still add. */
+#endif
+
+#ifdef VM
+    /* Owned by vm/page.c. */
+    struct hash pages;                  /* Supplemental page table. */
+
+    /* Owned by userprog/process.c. */
+    struct file *exec_file;             /* Executable, for demand paging. */
+
+    /* Owned by userprog/exception.c and userprog/syscall.c. */
+    void *user_esp;                     /* User %esp on entry to kernel. */
+
+    /* Owned by userprog/syscall.c. */
+    struct list mappings;               /* Memory-mapped files. */
+    int next_mapid;                     /* Next mapping id to hand out. */
 #endif
 
     /* Owned by thread.c. */
@@ -135,6 +181,12 @@ void thread_yield (void);
 typedef void thread_action_func (struct thread *t, void *aux);
 void thread_foreach (thread_action_func *, void *);
 
+void thread_preempt (void);
+void thread_refresh_priority (struct thread *);
+void thread_donate_priority (struct thread *, int priority);
+bool thread_priority_less (const struct list_elem *,
+                           const struct list_elem *, void *aux);
+
 int thread_get_priority (void);
 void thread_set_priority (int);
 struct thread* find_thread_tid(tid_t input_tid);
@@ -5,6 +5,10 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "userprog/syscall.h"
+#include "threads/vaddr.h"
+#ifdef VM
+#include "vm/page.h"
+#endif
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -149,6 +153,28 @@ page_fault (struct intr_frame *f)
   write = (f->error_code & PF_W) != 0;
   user = (f->error_code & PF_U) != 0;
 
+#ifdef VM
+  /* Bring in a page of the process that has not been touched
+     yet, or grow its stack.  This covers faults from the kernel
+     too, when a system call touches a user buffer, in which case
+     the user stack pointer was saved by the system call
+     handler. */
+  if (user)
+    thread_current ()->user_esp = f->esp;
+  if (not_present && is_user_vaddr (fault_addr) && page_load (fault_addr))
+    return;
+#endif
+
+  /* A fault in the kernel on a user address comes from get_user()
+     or put_user() in userprog/syscall.c, which put the address to
+     resume at in eax.  Return -1 to them there. */
+  if (!user && is_user_vaddr (fault_addr))
+    {
+      f->eip = (void (*) (void)) f->eax;
+      f->eax = 0xffffffff;
+      return;
+    }
+
   exit(-1);
   /* To implement virtual memory, delete the rest of the function
      body, and replace it with code that brings in the page to
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "userprog/gdt.h"
 #include "userprog/pagedir.h"
+#include "userprog/syscall.h"
 #include "userprog/tss.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
@@ -17,6 +18,9 @@
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
+#ifdef VM
+#include "vm/page.h"
+#endif
 
 static thread_func start_process NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
@@ -129,11 +133,23 @@ process_exit (void)
   struct thread *cur = thread_current ();
   uint32_t *pd;
 
+  /* Close any files the process left open. */
+  close_all_files ();
+
   /* Destroy the current process's page directory and switch back
      to the kernel-only page directory. */
   pd = cur->pagedir;
   if (pd != NULL) 
     {
+#ifdef VM
+      /* Give back the process's frames and swap slots while its
+         page directory still maps them. */
+      unmap_all_files ();
+      page_table_destroy (&cur->pages);
+      file_close (cur->exec_file);
+      cur->exec_file = NULL;
+#endif
+
       /* Correct ordering here is crucial.  We must set
          cur->pagedir to NULL before switching page directories,
          so that a timer interrupt can't switch back to the
@@ -250,6 +266,15 @@ load (const char *file_name, void (**eip) (void), void **esp)
   t->pagedir = pagedir_create ();
   if (t->pagedir == NULL) 
     goto done;
+#ifdef VM
+  if (!page_table_init (&t->pages))
+    {
+      pagedir_destroy (t->pagedir);
+      t->pagedir = NULL;
+      goto done;
+    }
+  list_init (&t->mappings);
+#endif
   process_activate ();
 
   char *fn_copy;
@@ -352,6 +377,13 @@ load (const char *file_name, void (**eip) (void), void **esp)
   add_exec_to_list(exec_name, thread_tid());
   success = true;
 
+#ifdef VM
+  /* Segment pages are read from the executable on demand, so keep
+     it open until the process exits. */
+  t->exec_file = file;
+  file = NULL;
+#endif
+
  done:
   /* We arrive here whether the load is successful or not. */
   file_close (file);
@@ -361,7 +393,9 @@ load (const char *file_name, void (**eip) (void), void **esp)
 
 /* load() helpers. */
 
+#ifndef VM
 static bool install_page (void *upage, void *kpage, bool writable);
+#endif
 
 /* Checks whether PHDR describes a valid, loadable segment in
    FILE and returns true if so, false otherwise. */
@@ -439,6 +473,13 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
       size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
       size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
+#ifdef VM
+      /* Just record where the page comes from.  It is read in
+         when the process first touches it. */
+      if (!page_add_file (upage, file, ofs, page_read_bytes, writable))
+        return false;
+      ofs += page_read_bytes;
+#else
       /* Get a page of memory. */
       uint8_t *kpage = palloc_get_page (PAL_USER);
       if (kpage == NULL)
@@ -458,6 +499,7 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
           palloc_free_page (kpage);
           return false; 
         }
+#endif
 
       /* Advance. */
       read_bytes -= page_read_bytes;
@@ -472,14 +514,22 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 static bool
 setup_stack (void **esp, char* file_name) 
 {
-  uint8_t *kpage;
   bool success = false;
 
   char *fn_copy;
   fn_copy = palloc_get_page (0);
   strlcpy (fn_copy, file_name, PGSIZE);
 
-  kpage = palloc_get_page (PAL_USER | PAL_ZERO);
+#ifdef VM
+  /* The stack page is a zero page like any other, except that it
+     is needed right away for the arguments. */
+  uint8_t *upage = ((uint8_t *) PHYS_BASE) - PGSIZE;
+  success = (page_add_file (upage, NULL, 0, 0, true)
+             && page_load (upage));
+  if (success)
+    *esp = PHYS_BASE;
+#else
+  uint8_t *kpage = palloc_get_page (PAL_USER | PAL_ZERO);
   if (kpage != NULL) 
     {
       success = install_page (((uint8_t *) PHYS_BASE) - PGSIZE, kpage, true);
@@ -488,6 +538,7 @@ setup_stack (void **esp, char* file_name)
       else
         palloc_free_page (kpage);
     }
+#endif
 
   char* restOfToken = file_name;
   char* firstArg;
@@ -566,6 +617,7 @@ setup_stack (void **esp, char* file_name)
   return success;
 }
 
+#ifndef VM
 /* Adds a mapping from user virtual address UPAGE to kernel
    virtual address KPAGE to the page table.
    If WRITABLE is true, the user process may modify the page;
@@ -585,3 +637,4 @@ install_page (void *upage, void *kpage, bool writable)
   return (pagedir_get_page (t->pagedir, upage) == NULL
           && pagedir_set_page (t->pagedir, upage, kpage, writable));
 }
+#endif
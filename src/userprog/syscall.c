@@ -13,21 +13,44 @@
 #include "filesys/off_t.h"
 #include "filesys/file.h"
 #include "filesys/inode.h"
-
-static int curr_descriptor, saved_status;
-static struct list file_descriptor_list;
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#ifdef VM
+#include <round.h>
+#include "vm/page.h"
+#endif
+
+//First fd handed out by open(); 0 and 1 are the console
+#define FD_FIRST 2
+//Initial number of slots in a process's fd table
+#define FD_TABLE_INITIAL_SIZE 16
+
+static int saved_status;
 static struct list executable_list;
-struct lock rw_lock;
 
+//An open file, found through the owning process's fd_table
 struct file_descriptor{
-	struct list_elem file_elem;
 	int num;
 	struct file* open_file;
 	int size;
-	int thread_opener;
 	bool is_directory;
 };
 
+//Cache of file descriptors, so open() and close() rarely take
+//the malloc() lock
+static struct kmem_cache* fd_cache;
+
+#ifdef VM
+//A memory-mapped file, in the owning process's mappings list
+struct mapping{
+	struct list_elem elem;
+	int id;
+	struct file* file;
+	void* addr;
+	size_t page_cnt;
+};
+#endif
+
 struct exec_descriptor{
 	struct list_elem exec_elem;
 	char* file_name;
@@ -36,7 +59,11 @@ struct exec_descriptor{
 
 //Prototypes
 static void syscall_handler (struct intr_frame *);
+static int get_arg(struct intr_frame *f, int n);
 void is_ptr_valid(const void *ptr);
+static char *copy_in_string(const char *str);
+void is_buffer_valid(const void *buffer, unsigned size, bool writable);
+void release_buffer(const void *buffer, unsigned size);
 int write (int fd, const void *buffer, unsigned size);
 bool create(const char *file, unsigned initial_size);
 int open (const char *file);
@@ -44,6 +71,7 @@ int read(int fd, void* buffer, unsigned size);
 int wait(int id);
 int exec(const char *cmd_line);
 struct file_descriptor* find_fd(int fd);
+static int allocate_fd(struct file_descriptor* fd);
 int find_file_size(int fd);
 void seek(int fd, unsigned position);
 void add_exec_to_list (char* file_name, int id);
@@ -54,154 +82,173 @@ bool mkdir(const char *dir);
 bool readdir(int fd, char *name);
 bool isdir(int fd);
 int inumber(int fd);
+#ifdef VM
+int mmap(int fd, void *addr);
+void munmap(int mapid);
+#endif
 
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-  curr_descriptor = 2;
   saved_status = NULL;
-  list_init(&file_descriptor_list);
   list_init(&executable_list);
-  lock_init(&rw_lock);
+  fd_cache = kmem_cache_create("file_descriptor",
+                               sizeof(struct file_descriptor), NULL);
+  if (fd_cache == NULL)
+    PANIC("syscall_init: out of memory");
 }
 
 static void
 syscall_handler (struct intr_frame *f UNUSED) 
 {
-	is_ptr_valid(f->esp);
+#ifdef VM
+	//Page faults in the kernel need this to recognize stack growth
+	thread_current()->user_esp = f->esp;
+#endif
+	int number = get_arg(f, 0);
 
 	//Check for valid syscall
-	if (*(int*)f->esp < SYS_HALT || *(int*)f->esp > SYS_INUMBER)
+	if (number < SYS_HALT || number > SYS_INUMBER)
 	{
 		exit(-1);
 	}
 
-	switch(*(int*)f->esp)
+	switch(number)
 	{
 		case SYS_WRITE:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			is_ptr_valid((int*)f->esp + 2);
-			is_ptr_valid((int*)f->esp + 3);
-
-			int fd = *((int*)f->esp + 1);
-			void* buffer = (void*)(*((int*)f->esp + 2));
-			unsigned size = *((unsigned*)f->esp + 3);
+			int fd = get_arg(f, 1);
+			void* buffer = (void*)get_arg(f, 2);
+			unsigned size = get_arg(f, 3);
 
-			is_ptr_valid(buffer);
+			is_buffer_valid(buffer, size, false);
 			f->eax = write(fd, buffer, size);
+			release_buffer(buffer, size);
 			break;
 		}
 		case SYS_CREATE:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			is_ptr_valid((int*)f->esp + 2);
-
-			void* filename = (void*)(*((int*)f->esp + 1));
-			unsigned size = *((unsigned*)f->esp + 2);
+			void* filename = (void*)get_arg(f, 1);
+			unsigned size = get_arg(f, 2);
 
 			if (filename == NULL)
 				exit(-1);
-			is_ptr_valid(filename);
+			char* kfilename = copy_in_string(filename);
 
-			f->eax = create(filename, size);
+			f->eax = create(kfilename, size);
+			palloc_free_page(kfilename);
 			break;
 		}
 		case SYS_READ:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			is_ptr_valid((int*)f->esp + 2);
-			is_ptr_valid((int*)f->esp + 3);
-
-			int fd = *((int*)f->esp + 1);
-			void* buffer = (void*)(*((int*)f->esp + 2));
-			unsigned size = *((unsigned*)f->esp + 3);
+			int fd = get_arg(f, 1);
+			void* buffer = (void*)get_arg(f, 2);
+			unsigned size = get_arg(f, 3);
 
-			is_ptr_valid(buffer);
+			is_buffer_valid(buffer, size, true);
 			f->eax = read(fd, buffer, size);
+			release_buffer(buffer, size);
 
 			break;
 		}
 		case SYS_OPEN:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			void* filename = (void*)(*((int*)f->esp + 1));
-			is_ptr_valid(filename);
+			void* filename = (void*)get_arg(f, 1);
+			char* kfilename = copy_in_string(filename);
 
-			f->eax = open(filename);
+			f->eax = open(kfilename);
+			palloc_free_page(kfilename);
 
 			break;
 		}
 		case SYS_WAIT:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			int pid = *((int*)f->esp + 1);
+			int pid = get_arg(f, 1);
 
 			f->eax = wait(pid);
 			break;
 		}
 		case SYS_EXEC:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			void* filename = (void*)(*((int*)f->esp + 1));
-			is_ptr_valid(filename);
+			void* filename = (void*)get_arg(f, 1);
+			char* kfilename = copy_in_string(filename);
 
-			f->eax = exec(filename);
+			f->eax = exec(kfilename);
+			palloc_free_page(kfilename);
 			break;
 		}
 		case SYS_FILESIZE:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			int fd = *((int*)f->esp + 1);
+			int fd = get_arg(f, 1);
 
 			f->eax = find_file_size(fd);
 			break;
 		}
 		case SYS_SEEK:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			is_ptr_valid((int*)f->esp + 2);
-
-			int fd = *((int*)f->esp + 1);
-			unsigned position = *((unsigned*)f->esp + 2);
+			int fd = get_arg(f, 1);
+			unsigned position = get_arg(f, 2);
 
 			seek(fd, position);
 			break;
 		}
 		case SYS_CLOSE:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			int fd = *((int*)f->esp + 1);
+			int fd = get_arg(f, 1);
 
 			close(fd);
 			break;
 		}
 		case SYS_EXIT:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			int status = *((int*)f->esp + 1);
+			int status = get_arg(f, 1);
 
 			exit(status);
 			break;
 		}
+		case SYS_CHDIR:
+		{
+			void* dirname = (void*)get_arg(f, 1);
+			char* kdirname = copy_in_string(dirname);
+
+			f->eax = chdir(kdirname);
+			palloc_free_page(kdirname);
+			break;
+		}
 		case SYS_MKDIR:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			void* filename = (void*)(*((int*)f->esp + 1));
-			is_ptr_valid(filename);
+			void* filename = (void*)get_arg(f, 1);
+			char* kfilename = copy_in_string(filename);
 
-			f->eax = mkdir(filename);
+			f->eax = mkdir(kfilename);
+			palloc_free_page(kfilename);
 			break;
 		}
 		case SYS_ISDIR:
 		{
-			is_ptr_valid((int*)f->esp + 1);
-			int fd = *((int*)f->esp + 1);
+			int fd = get_arg(f, 1);
+
+			f->eax = isdir(fd);
+			break;
+		}
+#ifdef VM
+		case SYS_MMAP:
+		{
+			int fd = get_arg(f, 1);
+			void* addr = (void*)get_arg(f, 2);
+
+			f->eax = mmap(fd, addr);
+			break;
+		}
+		case SYS_MUNMAP:
+		{
+			int mapid = get_arg(f, 1);
 
-			isdir(fd);
+			munmap(mapid);
 			break;
 		}
+#endif
 	}
 }
 
@@ -213,15 +260,129 @@ void exit (int status)
 	thread_exit();
 }
 
-//Check if it is a valid user pointer
+//Read the byte at user address uaddr, which must be below
+//PHYS_BASE. Returns the byte, or -1 if the access faulted: the
+//page fault handler resumes at label 1 with eax set to -1
+static int get_user(const uint8_t *uaddr)
+{
+	int result;
+	asm ("movl $1f, %0; movzbl %1, %0; 1:"
+	     : "=&a" (result) : "m" (*uaddr));
+	return result;
+}
+
+//Write byte to user address udst, which must be below PHYS_BASE.
+//Returns false if the access faulted
+static bool put_user(uint8_t *udst, uint8_t byte)
+{
+	int error_code;
+	asm ("movl $1f, %0; movb %b2, %1; 1:"
+	     : "=&a" (error_code), "=m" (*udst) : "q" (byte));
+	return error_code != -1;
+}
+
+//Check that ptr is a user address the process may read. Touching
+//the byte lets the MMU do the check, bringing in the page under VM
 void is_ptr_valid(const void *ptr)
 {
-	if (ptr < (void*)0x8048000 || ptr > PHYS_BASE || ptr == NULL)
+	if (ptr < (void*)0x8048000 || !is_user_vaddr(ptr))
 		exit(-1);
-	if (!is_user_vaddr(ptr))
+	if (get_user(ptr) == -1)
 		exit(-1);
-	if (pagedir_get_page(thread_current()->pagedir, ptr) == NULL)
+}
+
+//Copy size bytes from user address usrc to dst, exiting if any of
+//them cannot be read
+static void copy_in(void *dst_, const void *usrc_, size_t size)
+{
+	uint8_t *dst = dst_;
+	const uint8_t *usrc = usrc_;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+	{
+		int byte;
+		if (!is_user_vaddr(usrc + i) || (byte = get_user(usrc + i)) == -1)
+			exit(-1);
+		dst[i] = byte;
+	}
+}
+
+//Fetch the 32-bit word n places above the user stack pointer: the
+//syscall number for n == 0, then its arguments
+static int get_arg(struct intr_frame *f, int n)
+{
+	int value;
+	copy_in(&value, (int*)f->esp + n, sizeof value);
+	return value;
+}
+
+//Copy the user string str, up to and including its null
+//terminator, into a new kernel page, exiting if any byte of it
+//cannot be read or it does not fit. The file system then never
+//faults on a path, which it may walk inside a journal handle.
+//Free the copy with palloc_free_page()
+static char *copy_in_string(const char *str)
+{
+	char *ks = palloc_get_page(0);
+	size_t i;
+
+	if (ks == NULL)
 		exit(-1);
+	for (i = 0; i < PGSIZE; i++)
+	{
+		int c;
+		if (!is_user_vaddr(str + i) || (c = get_user((const uint8_t*)str + i)) == -1)
+			break;
+		ks[i] = c;
+		if (c == '\0')
+			return ks;
+	}
+	palloc_free_page(ks);
+	exit(-1);
+	NOT_REACHED();
+}
+
+//Check a user buffer by touching one byte of each page it spans,
+//so each page is walked once however large the buffer. If
+//writable, the process must be able to write the buffer too.
+//With VM, the pages are also pinned so that the file system never
+//faults on them while holding a buffer cache lock; call
+//release_buffer() when done with it
+void is_buffer_valid(const void *buffer, unsigned size, bool writable)
+{
+	const uint8_t *page = pg_round_down(buffer);
+
+	do
+	{
+		uint8_t *p = (uint8_t*)(page < (const uint8_t*)buffer ? buffer : page);
+		int byte;
+
+		if (p < (uint8_t*)0x8048000 || !is_user_vaddr(p))
+			exit(-1);
+		byte = get_user(p);
+		if (byte == -1 || (writable && !put_user(p, byte)))
+			exit(-1);
+#ifdef VM
+		if (!page_pin(page))
+			exit(-1);
+#endif
+		page += PGSIZE;
+	} while (page < (const uint8_t*)buffer + size);
+}
+
+//Unpin a buffer checked with is_buffer_valid()
+void release_buffer(const void *buffer UNUSED, unsigned size UNUSED)
+{
+#ifdef VM
+	const uint8_t *page = pg_round_down(buffer);
+
+	do
+	{
+		page_unpin(page);
+		page += PGSIZE;
+	} while (page < (const uint8_t*)buffer + size);
+#endif
 }
 
 //Write to the stack
@@ -245,19 +406,65 @@ int write (int fd, const void *buffer, unsigned size)
 	return size_written;
 }
 
-//List finder
+//Look up fd in the current process's fd table, NULL if not open
 struct file_descriptor* find_fd(int fd){
-	struct list_elem *it;
-	struct file_descriptor *currFd;
+	struct thread* cur = thread_current();
+
+	if (fd < FD_FIRST || fd >= cur->fd_table_size)
+		return NULL;
+	return cur->fd_table[fd];
+}
+
+//Store fd in the lowest free slot of the current process's fd
+//table, growing the table if it is full. Returns the new fd
+//number, or -1 if the table could not be grown.
+static int allocate_fd(struct file_descriptor* fd)
+{
+	struct thread* cur = thread_current();
+	int num;
 
-	for (it = list_begin(&file_descriptor_list); it!=list_end(&file_descriptor_list); it = list_next(it))
+	num = cur->fd_lowest_free > FD_FIRST ? cur->fd_lowest_free : FD_FIRST;
+	for (; num < cur->fd_table_size; num++)
+		if (cur->fd_table[num] == NULL)
+			break;
+
+	if (num >= cur->fd_table_size)
 	{
-		currFd = list_entry(it, struct file_descriptor, file_elem);
-		if (currFd->num == fd)
-			return currFd;
+		int new_size = cur->fd_table_size == 0 ? FD_TABLE_INITIAL_SIZE
+		                                       : cur->fd_table_size * 2;
+		struct file_descriptor** new_table = realloc(cur->fd_table,
+		                                             new_size * sizeof *new_table);
+		if (new_table == NULL)
+			return -1;
+		memset(new_table + cur->fd_table_size, 0,
+		       (new_size - cur->fd_table_size) * sizeof *new_table);
+		cur->fd_table = new_table;
+		cur->fd_table_size = new_size;
 	}
 
-	return NULL;
+	cur->fd_table[num] = fd;
+	cur->fd_lowest_free = num + 1;
+	fd->num = num;
+	return num;
+}
+
+//Close every file the current process still has open and free
+//its fd table
+void close_all_files(void)
+{
+	struct thread* cur = thread_current();
+	int num;
+
+	for (num = FD_FIRST; num < cur->fd_table_size; num++)
+		if (cur->fd_table[num] != NULL)
+		{
+			file_close(cur->fd_table[num]->open_file);
+			kmem_cache_free(fd_cache, cur->fd_table[num]);
+		}
+	free(cur->fd_table);
+	cur->fd_table = NULL;
+	cur->fd_table_size = 0;
+	cur->fd_lowest_free = FD_FIRST;
 }
 
 ///SYSCALL Functions
@@ -286,17 +493,24 @@ int open (const char *file)
   		file_deny_write(opened_file);
 
   	//Create file descriptor struct
-  	struct file_descriptor* fd = malloc(sizeof(struct file_descriptor));
-  	curr_descriptor++;
-  	fd->num = curr_descriptor;
+  	struct file_descriptor* fd = kmem_cache_alloc(fd_cache);
+  	if (fd == NULL)
+  	{
+  		file_close(opened_file);
+  		return -1;
+  	}
   	fd->open_file = opened_file;
-  	fd->is_directory = false;
+  	fd->is_directory = inode_is_dir(file_get_inode(opened_file));
   	fd->size = file_length(opened_file);
-  	fd->thread_opener = thread_tid();
 
-  	list_push_back(&file_descriptor_list, &(fd->file_elem));
+  	if (allocate_fd(fd) == -1)
+  	{
+  		file_close(opened_file);
+  		kmem_cache_free(fd_cache, fd);
+  		return -1;
+  	}
 
-  	return curr_descriptor;
+  	return fd->num;
 }
 
 int read(int fd, void* buffer, unsigned size)
@@ -380,14 +594,16 @@ bool find_exec_in_list(char* f)
 
 void close(int fd)
 {
+	struct thread* cur = thread_current();
 	struct file_descriptor* curr_descriptor = find_fd(fd);
-	if (thread_tid() != curr_descriptor->thread_opener)
-		return;
 	if (curr_descriptor != NULL)
 	{
-		//Remove fd
-		list_remove(&(curr_descriptor->file_elem));
+		//Free the slot so open() can reuse the lowest fd
+		cur->fd_table[fd] = NULL;
+		if (fd < cur->fd_lowest_free)
+			cur->fd_lowest_free = fd;
 		file_close(curr_descriptor->open_file);
+		kmem_cache_free(fd_cache, curr_descriptor);
 	}
 	else{
 		exit(-1);
@@ -396,21 +612,121 @@ void close(int fd)
 
 bool chdir(const char *dir)
 {
-	return false;
+	return filesys_chdir(dir);
 }
 
 bool mkdir(const char *dir)
 {
-	//Empty directory name
-	if (strcmp(dir,"") == 0)
-		return false;
-
-	bool success = filesys_create(dir, 1);
-  	return success;
+	return filesys_mkdir(dir);
 }
 
 bool isdir(int fd)
 {
 	struct file_descriptor* curr_descriptor = find_fd(fd);
+	if (curr_descriptor == NULL)
+		exit(-1);
 	return curr_descriptor->is_directory;
-}
\ No newline at end of file
+}
+
+#ifdef VM
+//Map the file open as fd into consecutive pages starting at addr.
+//Pages are read in from the file when first touched and written
+//back only if modified. Returns the mapping id, or -1 on failure
+int mmap(int fd, void *addr)
+{
+	struct thread* cur = thread_current();
+	struct file_descriptor* curr_descriptor = find_fd(fd);
+	struct mapping* m;
+	off_t length;
+	size_t i;
+
+	if (curr_descriptor == NULL || curr_descriptor->is_directory)
+		return -1;
+	if (addr == NULL || pg_ofs(addr) != 0)
+		return -1;
+	length = file_length(curr_descriptor->open_file);
+	if (length == 0)
+		return -1;
+
+	m = malloc(sizeof *m);
+	if (m == NULL)
+		return -1;
+	m->addr = addr;
+	m->page_cnt = DIV_ROUND_UP(length, PGSIZE);
+
+	//Every page must be free user address space
+	for (i = 0; i < m->page_cnt; i++)
+	{
+		uint8_t* upage = (uint8_t*)addr + i * PGSIZE;
+		if (!is_user_vaddr(upage) || upage < (uint8_t*)addr || page_lookup(upage) != NULL)
+		{
+			free(m);
+			return -1;
+		}
+	}
+
+	//The mapping outlives close() on fd, so it gets its own file
+	m->file = file_reopen(curr_descriptor->open_file);
+	if (m->file == NULL)
+	{
+		free(m);
+		return -1;
+	}
+
+	for (i = 0; i < m->page_cnt; i++)
+	{
+		off_t ofs = i * PGSIZE;
+		size_t read_bytes = length - ofs < PGSIZE ? length - ofs : PGSIZE;
+		if (!page_add_mmap((uint8_t*)addr + ofs, m->file, ofs, read_bytes))
+		{
+			while (i-- > 0)
+				page_remove((uint8_t*)addr + i * PGSIZE);
+			file_close(m->file);
+			free(m);
+			return -1;
+		}
+	}
+
+	m->id = cur->next_mapid++;
+	list_push_back(&cur->mappings, &m->elem);
+	return m->id;
+}
+
+//Write back and remove the pages of mapping m, then free it
+static void unmap(struct mapping* m)
+{
+	size_t i;
+
+	for (i = 0; i < m->page_cnt; i++)
+		page_remove((uint8_t*)m->addr + i * PGSIZE);
+	list_remove(&m->elem);
+	file_close(m->file);
+	free(m);
+}
+
+//Unmap the mapping with id mapid, if the current process has it
+void munmap(int mapid)
+{
+	struct thread* cur = thread_current();
+	struct list_elem* e;
+
+	for (e = list_begin(&cur->mappings); e != list_end(&cur->mappings); e = list_next(e))
+	{
+		struct mapping* m = list_entry(e, struct mapping, elem);
+		if (m->id == mapid)
+		{
+			unmap(m);
+			return;
+		}
+	}
+}
+
+//Unmap every file the current process still has mapped
+void unmap_all_files(void)
+{
+	struct thread* cur = thread_current();
+
+	while (!list_empty(&cur->mappings))
+		unmap(list_entry(list_front(&cur->mappings), struct mapping, elem));
+}
+#endif
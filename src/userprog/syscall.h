@@ -4,6 +4,10 @@
 void syscall_init (void);
 
 void exit (int status);
+void close_all_files (void);
+#ifdef VM
+void unmap_all_files (void);
+#endif
 
 int write (int fd, const void *buffer, unsigned size);
 
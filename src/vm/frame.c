@@ -0,0 +1,193 @@
+#include "vm/frame.h"
+#include <debug.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "userprog/pagedir.h"
+#include "vm/page.h"
+
+/* Frame table.
+
+   Every frame of the user pool that holds a process's page is
+   in frame_list.  When the user pool runs dry, frame_alloc()
+   takes a frame away from some page, chosen by the second-chance
+   clock algorithm: the clock hand sweeps around the list,
+   clearing the accessed bit of recently used pages and stopping
+   at the first one whose bit is already clear.
+
+   frame_lock protects frame_list, the clock hand, every frame's
+   members, and the FRAME and EVICTING members of every page.  It
+   is not held while a victim is written to swap or to its file,
+   because that write may have to wait for the journal to commit,
+   and a thread inside a journal handle may be waiting for
+   frame_lock.  Instead the victim's frame stays pinned and its
+   page is marked as being evicted, and a thread that wants the
+   page waits on frame_evicted until the page is safely out. */
+
+static struct list frame_list;          /* All frames in use. */
+static struct list_elem *clock_hand;    /* Next eviction candidate. */
+static struct lock frame_lock;
+static struct condition frame_evicted;  /* Signaled after evictions. */
+
+static struct frame *choose_victim (void);
+static void wait_for_eviction (struct page *);
+
+/* Initializes the frame table. */
+void
+frame_init (void)
+{
+  list_init (&frame_list);
+  clock_hand = list_end (&frame_list);
+  lock_init (&frame_lock);
+  cond_init (&frame_evicted);
+}
+
+/* Obtains a frame for page P of the process with page directory
+   PAGEDIR, evicting another page if the user pool is exhausted.
+   The frame is returned pinned and recorded as P's frame; the
+   caller fills it, maps it, and then unpins it.  Returns a null
+   pointer if every frame is pinned or the victim cannot be
+   written to swap. */
+struct frame *
+frame_alloc (struct page *p, uint32_t *pagedir)
+{
+  struct frame *f = NULL;
+  void *kpage;
+
+  lock_acquire (&frame_lock);
+  kpage = palloc_get_page (PAL_USER);
+  if (kpage != NULL)
+    {
+      f = malloc (sizeof *f);
+      if (f == NULL)
+        palloc_free_page (kpage);
+      else
+        {
+          f->kpage = kpage;
+          list_push_back (&frame_list, &f->elem);
+        }
+    }
+  else
+    {
+      f = choose_victim ();
+      if (f != NULL)
+        {
+          struct page *victim = f->page;
+          bool evicted;
+
+          f->pinned = true;
+          victim->evicting = true;
+          lock_release (&frame_lock);
+          evicted = page_evict (victim, f->pagedir, f->kpage);
+          lock_acquire (&frame_lock);
+          victim->evicting = false;
+          cond_broadcast (&frame_evicted, &frame_lock);
+          if (evicted)
+            victim->frame = NULL;
+          else
+            {
+              f->pinned = false;
+              f = NULL;
+            }
+        }
+    }
+
+  if (f != NULL)
+    {
+      f->page = p;
+      f->pagedir = pagedir;
+      f->pinned = true;
+      p->frame = f;
+    }
+  lock_release (&frame_lock);
+  return f;
+}
+
+/* Frees the frame of page P, if it has one, unmapping P. */
+void
+frame_release (struct page *p)
+{
+  struct frame *f;
+
+  lock_acquire (&frame_lock);
+  wait_for_eviction (p);
+  f = p->frame;
+  if (f != NULL)
+    {
+      if (clock_hand == &f->elem)
+        clock_hand = list_next (clock_hand);
+      list_remove (&f->elem);
+      pagedir_clear_page (f->pagedir, p->upage);
+      palloc_free_page (f->kpage);
+      free (f);
+      p->frame = NULL;
+    }
+  lock_release (&frame_lock);
+}
+
+/* Pins the frame of page P, so that it will not be evicted, and
+   returns true.  Returns false if P is not in a frame, waiting
+   first for P to leave its frame if it is being evicted. */
+bool
+frame_pin (struct page *p)
+{
+  bool pinned = false;
+
+  lock_acquire (&frame_lock);
+  wait_for_eviction (p);
+  if (p->frame != NULL)
+    {
+      p->frame->pinned = true;
+      pinned = true;
+    }
+  lock_release (&frame_lock);
+  return pinned;
+}
+
+/* Unpins frame F, making it a candidate for eviction again. */
+void
+frame_unpin (struct frame *f)
+{
+  lock_acquire (&frame_lock);
+  ASSERT (f->pinned);
+  f->pinned = false;
+  lock_release (&frame_lock);
+}
+
+/* Chooses a frame to evict with the clock algorithm.  Returns a
+   null pointer if every frame is pinned.  The caller must hold
+   frame_lock. */
+static struct frame *
+choose_victim (void)
+{
+  size_t i;
+
+  /* Two sweeps are enough: the first clears every accessed bit
+     it passes. */
+  for (i = 0; i < 2 * list_size (&frame_list); i++)
+    {
+      struct frame *f;
+
+      if (clock_hand == list_end (&frame_list))
+        clock_hand = list_begin (&frame_list);
+      f = list_entry (clock_hand, struct frame, elem);
+      clock_hand = list_next (clock_hand);
+
+      if (f->pinned)
+        continue;
+      if (pagedir_is_accessed (f->pagedir, f->page->upage))
+        pagedir_set_accessed (f->pagedir, f->page->upage, false);
+      else
+        return f;
+    }
+  return NULL;
+}
+
+/* Waits until page P is not being evicted.  The caller must hold
+   frame_lock. */
+static void
+wait_for_eviction (struct page *p)
+{
+  while (p->evicting)
+    cond_wait (&frame_evicted, &frame_lock);
+}
@@ -0,0 +1,26 @@
+#ifndef VM_FRAME_H
+#define VM_FRAME_H
+
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct page;
+
+/* A frame from the user pool holding a process's page. */
+struct frame
+  {
+    struct list_elem elem;              /* Element in frame table. */
+    void *kpage;                        /* Kernel virtual address. */
+    struct page *page;                  /* Page held. */
+    uint32_t *pagedir;                  /* Page directory mapping PAGE. */
+    bool pinned;                        /* Not to be evicted? */
+  };
+
+void frame_init (void);
+struct frame *frame_alloc (struct page *, uint32_t *pagedir);
+void frame_release (struct page *);
+bool frame_pin (struct page *);
+void frame_unpin (struct frame *);
+
+#endif /* vm/frame.h */
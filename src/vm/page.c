@@ -0,0 +1,322 @@
+#include "vm/page.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+#include "vm/frame.h"
+#include "vm/swap.h"
+
+/* Supplemental page table.
+
+   Each process keeps a hash table of the pages in its address
+   space, keyed by user virtual address.  load() records each
+   page of the executable's segments here instead of reading it,
+   and page_fault() calls page_load() to read a page in the first
+   time the process touches it.  So a process only pays, in time
+   and in memory, for the pages that it actually uses.
+
+   When memory runs short, vm/frame.c evicts pages through
+   page_evict(), which writes modified pages to swap. */
+
+static hash_hash_func page_hash;
+static hash_less_func page_less;
+static hash_action_func page_free;
+static struct page *find_page (const void *addr);
+static bool load_page (struct page *, bool keep_pinned);
+static void discard_page (struct page *);
+
+/* Initializes PAGES as an empty supplemental page table.
+   Returns false if memory allocation fails. */
+bool
+page_table_init (struct hash *pages)
+{
+  return hash_init (pages, page_hash, page_less, NULL);
+}
+
+/* Frees every entry in supplemental page table PAGES, along with
+   the frames and swap slots that they use.  Must be called
+   before the process's page directory is destroyed. */
+void
+page_table_destroy (struct hash *pages)
+{
+  hash_destroy (pages, page_free);
+}
+
+/* Adds a page at user virtual address UPAGE to the current
+   process's supplemental page table.  The page's contents are
+   READ_BYTES bytes read from FILE starting at offset OFS,
+   followed by PGSIZE - READ_BYTES zero bytes; FILE may be null
+   if READ_BYTES is 0.  The page is read-only unless WRITABLE is
+   true.  Returns false if UPAGE is already in the table or if
+   memory allocation fails. */
+bool
+page_add_file (void *upage, struct file *file, off_t ofs,
+               size_t read_bytes, bool writable)
+{
+  struct thread *t = thread_current ();
+  struct page *p;
+
+  ASSERT (pg_ofs (upage) == 0);
+  ASSERT (read_bytes <= PGSIZE);
+
+  p = malloc (sizeof *p);
+  if (p == NULL)
+    return false;
+  p->upage = upage;
+  p->writable = writable;
+  p->file = file;
+  p->ofs = ofs;
+  p->read_bytes = read_bytes;
+  p->mmap = false;
+  p->dirty = false;
+  p->swap_slot = SWAP_NONE;
+  p->frame = NULL;
+  p->evicting = false;
+
+  if (hash_insert (&t->pages, &p->hash_elem) != NULL)
+    {
+      free (p);
+      return false;
+    }
+  return true;
+}
+
+/* Adds a page at user virtual address UPAGE, mapping READ_BYTES
+   bytes of FILE starting at offset OFS, to the current process's
+   supplemental page table, as page_add_file() does.  The page is
+   writable, and modifications are written back to FILE.  Returns
+   false if UPAGE is already in the table or if memory allocation
+   fails. */
+bool
+page_add_mmap (void *upage, struct file *file, off_t ofs,
+               size_t read_bytes)
+{
+  struct page *p;
+
+  if (!page_add_file (upage, file, ofs, read_bytes, true))
+    return false;
+  p = page_lookup (upage);
+  p->mmap = true;
+  return true;
+}
+
+/* Removes the current process's page at UPAGE, writing it back
+   to its file first if it is a modified page of a memory-mapped
+   file. */
+void
+page_remove (void *upage)
+{
+  struct thread *t = thread_current ();
+  struct page *p = page_lookup (upage);
+
+  ASSERT (p != NULL);
+  hash_delete (&t->pages, &p->hash_elem);
+  discard_page (p);
+}
+
+/* Returns the current process's page containing UPAGE, or a
+   null pointer if there is no such page. */
+struct page *
+page_lookup (const void *upage)
+{
+  struct thread *t = thread_current ();
+  struct page p;
+  struct hash_elem *e;
+
+  p.upage = pg_round_down (upage);
+  e = hash_find (&t->pages, &p.hash_elem);
+  return e != NULL ? hash_entry (e, struct page, hash_elem) : NULL;
+}
+
+/* Returns the current process's page containing ADDR.  If there
+   is none, but ADDR looks like an access to the stack, grows the
+   stack to cover it: ADDR must be within STACK_MAX of the top of
+   user memory and no more than STACK_SLOP bytes below the user
+   stack pointer.  Returns a null pointer otherwise. */
+static struct page *
+find_page (const void *addr)
+{
+  struct thread *t = thread_current ();
+  struct page *p = page_lookup (addr);
+  uint8_t *upage = pg_round_down (addr);
+
+  if (p == NULL
+      && is_user_vaddr (addr)
+      && (uint8_t *) addr >= (uint8_t *) PHYS_BASE - STACK_MAX
+      && (uint8_t *) addr + STACK_SLOP >= (uint8_t *) t->user_esp
+      && page_add_file (upage, NULL, 0, 0, true))
+    p = page_lookup (upage);
+  return p;
+}
+
+/* Brings the page containing ADDR into memory and maps it in the
+   current process's page directory, growing the stack if ADDR is
+   a stack access.  Returns false if ADDR is not in any page of
+   the process, or if a frame cannot be obtained or the page's
+   contents cannot be read. */
+bool
+page_load (const void *addr)
+{
+  struct page *p = find_page (addr);
+  return p != NULL && load_page (p, false);
+}
+
+/* Brings the page containing ADDR into memory, as page_load()
+   does, and pins it there until page_unpin() is called, so that
+   the kernel can access it without faulting. */
+bool
+page_pin (const void *addr)
+{
+  struct page *p = find_page (addr);
+  return p != NULL && load_page (p, true);
+}
+
+/* Unpins the page containing ADDR, which must have been pinned
+   with page_pin(). */
+void
+page_unpin (const void *addr)
+{
+  struct page *p = page_lookup (addr);
+
+  ASSERT (p != NULL && p->frame != NULL);
+  frame_unpin (p->frame);
+}
+
+/* Takes page P, which is in frame KPAGE and mapped in PAGEDIR,
+   out of memory.  A modified page is written to swap; any other
+   page is simply dropped, since it can be read again from its
+   file or is all zeros.  Returns false, leaving the page in
+   place, if swap is full.  Called by vm/frame.c, which keeps
+   the frame pinned and clears P's FRAME afterward, without the
+   frame table locked. */
+bool
+page_evict (struct page *p, uint32_t *pagedir, void *kpage)
+{
+  enum intr_level old_level;
+  bool dirty;
+
+  /* Unmap the page before looking at it any further, so that the
+     process faults and waits for us if it touches the page.  No
+     other thread may run between checking the dirty bit and
+     unmapping, or a write could slip in between. */
+  old_level = intr_disable ();
+  dirty = pagedir_is_dirty (pagedir, p->upage);
+  pagedir_clear_page (pagedir, p->upage);
+  intr_set_level (old_level);
+
+  if (p->mmap)
+    {
+      if (dirty)
+        file_write_at (p->file, kpage, p->read_bytes, p->ofs);
+      return true;
+    }
+
+  if (dirty)
+    p->dirty = true;
+  if (p->dirty)
+    {
+      p->swap_slot = swap_out (kpage);
+      if (p->swap_slot == SWAP_NONE)
+        {
+          pagedir_set_page (pagedir, p->upage, kpage, p->writable);
+          return false;
+        }
+    }
+  return true;
+}
+
+/* Brings page P of the current process into a frame, if it is
+   not already in one, and maps it.  If KEEP_PINNED is true, the
+   frame is left pinned. */
+static bool
+load_page (struct page *p, bool keep_pinned)
+{
+  struct thread *t = thread_current ();
+  struct frame *f;
+
+  if (frame_pin (p))
+    {
+      if (!keep_pinned)
+        frame_unpin (p->frame);
+      return true;
+    }
+
+  f = frame_alloc (p, t->pagedir);
+  if (f == NULL)
+    return false;
+
+  if (p->swap_slot != SWAP_NONE)
+    {
+      swap_in (p->swap_slot, f->kpage);
+      p->swap_slot = SWAP_NONE;
+    }
+  else
+    {
+      if (p->read_bytes > 0
+          && file_read_at (p->file, f->kpage, p->read_bytes, p->ofs)
+             != (off_t) p->read_bytes)
+        {
+          frame_release (p);
+          return false;
+        }
+      memset ((uint8_t *) f->kpage + p->read_bytes, 0,
+              PGSIZE - p->read_bytes);
+    }
+
+  if (!pagedir_set_page (t->pagedir, p->upage, f->kpage, p->writable))
+    {
+      frame_release (p);
+      return false;
+    }
+  if (!keep_pinned)
+    frame_unpin (f);
+  return true;
+}
+
+/* Returns a hash value for the page that E refers to. */
+static unsigned
+page_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct page *p = hash_entry (e, struct page, hash_elem);
+  return hash_bytes (&p->upage, sizeof p->upage);
+}
+
+/* Returns true if page A precedes page B. */
+static bool
+page_less (const struct hash_elem *a_, const struct hash_elem *b_,
+           void *aux UNUSED)
+{
+  const struct page *a = hash_entry (a_, struct page, hash_elem);
+  const struct page *b = hash_entry (b_, struct page, hash_elem);
+  return a->upage < b->upage;
+}
+
+/* Frees the page that E refers to, with its frame and swap
+   slot. */
+static void
+page_free (struct hash_elem *e, void *aux UNUSED)
+{
+  discard_page (hash_entry (e, struct page, hash_elem));
+}
+
+/* Frees page P of the current process, with its frame and swap
+   slot, after writing it back to its file if it is a modified
+   page of a memory-mapped file.  P must already be out of the
+   supplemental page table. */
+static void
+discard_page (struct page *p)
+{
+  struct thread *t = thread_current ();
+
+  if (p->mmap && frame_pin (p)
+      && pagedir_is_dirty (t->pagedir, p->upage))
+    file_write_at (p->file, p->frame->kpage, p->read_bytes, p->ofs);
+  frame_release (p);
+  if (p->swap_slot != SWAP_NONE)
+    swap_free (p->swap_slot);
+  free (p);
+}
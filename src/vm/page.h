@@ -0,0 +1,62 @@
+#ifndef VM_PAGE_H
+#define VM_PAGE_H
+
+#include <hash.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "filesys/off_t.h"
+
+/* Maximum size of a process's stack, which grows on demand. */
+#define STACK_MAX (8 * 1024 * 1024)
+
+/* How far below the stack pointer an access may fault and still
+   grow the stack.  PUSHA checks 32 bytes below %esp before it
+   moves %esp. */
+#define STACK_SLOP 32
+
+/* A page of a process's virtual address space, as recorded in
+   the process's supplemental page table.  A page is not given a
+   frame until it is first touched, and may lose its frame again
+   to eviction; while it has none, the entry records where its
+   contents are. */
+struct page
+  {
+    struct hash_elem hash_elem;         /* Element in thread's pages. */
+    void *upage;                        /* User virtual address. */
+    bool writable;                      /* Writable by the process? */
+
+    /* Initial contents: READ_BYTES bytes from FILE starting at
+       OFS, followed by zeros to the end of the page. */
+    struct file *file;                  /* File to read, or null. */
+    off_t ofs;                          /* Offset in FILE. */
+    size_t read_bytes;                  /* Bytes to read from FILE. */
+
+    /* A page of a memory-mapped file is written back to FILE
+       when it is evicted or unmapped, if it was modified.  Once
+       any other page has been modified, its contents no longer
+       come from FILE but from swap whenever it is not in a
+       frame. */
+    bool mmap;                          /* Memory-mapped file page? */
+    bool dirty;                         /* Ever modified? */
+    size_t swap_slot;                   /* Swap slot, or SWAP_NONE. */
+
+    struct frame *frame;                /* Frame, or null if none. */
+    bool evicting;                      /* Being written out of FRAME? */
+  };
+
+bool page_table_init (struct hash *);
+void page_table_destroy (struct hash *);
+
+bool page_add_file (void *upage, struct file *, off_t ofs,
+                    size_t read_bytes, bool writable);
+bool page_add_mmap (void *upage, struct file *, off_t ofs,
+                    size_t read_bytes);
+void page_remove (void *upage);
+struct page *page_lookup (const void *upage);
+bool page_load (const void *addr);
+bool page_pin (const void *addr);
+void page_unpin (const void *addr);
+bool page_evict (struct page *, uint32_t *pagedir, void *kpage);
+
+#endif /* vm/page.h */
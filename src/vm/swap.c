@@ -0,0 +1,77 @@
+#include "vm/swap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <stdio.h>
+#include "devices/block.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Swap space.
+
+   The BLOCK_SWAP device is divided into page-sized slots, each
+   SECTORS_PER_SLOT consecutive sectors, tracked by a bitmap.  A
+   page is moved in or out with a single multi-sector transfer. */
+
+/* Number of sectors in a swap slot. */
+#define SECTORS_PER_SLOT (PGSIZE / BLOCK_SECTOR_SIZE)
+
+static struct block *swap_device;       /* Swap device, or null. */
+static struct bitmap *swap_slots;       /* Slots in use. */
+static struct lock swap_lock;           /* Protects swap_slots. */
+
+/* Initializes swap space on the BLOCK_SWAP device, if there is
+   one.  Without one, swap_out() always fails. */
+void
+swap_init (void)
+{
+  size_t slot_cnt = 0;
+
+  lock_init (&swap_lock);
+  swap_device = block_get_role (BLOCK_SWAP);
+  if (swap_device != NULL)
+    slot_cnt = block_size (swap_device) / SECTORS_PER_SLOT;
+  else
+    printf ("swap: no swap device, running without swap\n");
+
+  swap_slots = bitmap_create (slot_cnt);
+  if (swap_slots == NULL)
+    PANIC ("swap bitmap creation failed--swap device is too large");
+}
+
+/* Writes the page at KPAGE to a free swap slot and returns the
+   slot's number, or SWAP_NONE if swap space is full. */
+size_t
+swap_out (const void *kpage)
+{
+  size_t slot;
+
+  lock_acquire (&swap_lock);
+  slot = bitmap_scan_and_flip (swap_slots, 0, 1, false);
+  lock_release (&swap_lock);
+  if (slot == BITMAP_ERROR)
+    return SWAP_NONE;
+
+  block_write_multi (swap_device, slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT,
+                     kpage);
+  return slot;
+}
+
+/* Reads swap slot SLOT into the page at KPAGE and frees the
+   slot. */
+void
+swap_in (size_t slot, void *kpage)
+{
+  block_read_multi (swap_device, slot * SECTORS_PER_SLOT, SECTORS_PER_SLOT,
+                    kpage);
+  swap_free (slot);
+}
+
+/* Frees swap slot SLOT without reading it. */
+void
+swap_free (size_t slot)
+{
+  lock_acquire (&swap_lock);
+  ASSERT (bitmap_test (swap_slots, slot));
+  bitmap_reset (swap_slots, slot);
+  lock_release (&swap_lock);
+}